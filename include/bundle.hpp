@@ -0,0 +1,97 @@
+//
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// 小さいファイルをまとめて1回で転送するための形式
+// レコード: [パス長(u32)][パス][更新時刻(u64)][サイズ(u64)][データ]
+namespace Bundle
+{
+namespace fs = boost::filesystem;
+using Buffer = std::vector<char>;
+
+struct Record
+{
+  std::string path_;
+  uint64_t    mtime_;
+  const char* data_;
+  uint64_t    size_;
+};
+
+namespace detail
+{
+template <class T>
+void
+put(Buffer& out, T v)
+{
+  auto p = reinterpret_cast<const char*>(&v);
+  out.insert(out.end(), p, p + sizeof(T));
+}
+template <class T>
+bool
+get(const Buffer& in, size_t& ofs, T& v)
+{
+  if (ofs + sizeof(T) > in.size())
+    return false;
+  std::memcpy(&v, &in[ofs], sizeof(T));
+  ofs += sizeof(T);
+  return true;
+}
+} // namespace detail
+
+// ファイル1つ分を追加(読めなかった場合はfalse)
+inline bool
+append(Buffer& out, const std::string& path, const fs::path& fullpath)
+{
+  boost::system::error_code err;
+  auto                      size  = fs::file_size(fullpath, err);
+  auto                      mtime = fs::last_write_time(fullpath, err);
+  std::ifstream             infile(fullpath.generic_string(), std::ios::binary);
+  if (err || !infile)
+    return false;
+
+  detail::put<uint32_t>(out, path.size());
+  out.insert(out.end(), path.begin(), path.end());
+  detail::put<uint64_t>(out, mtime);
+  auto size_ofs = out.size();
+  detail::put<uint64_t>(out, size);
+  auto data_ofs = out.size();
+  out.resize(data_ofs + size);
+  infile.read(&out[data_ofs], size);
+  // 読み込み中にサイズが変わった場合は読めた分だけにする
+  uint64_t nb = infile.gcount();
+  out.resize(data_ofs + nb);
+  std::memcpy(&out[size_ofs], &nb, sizeof(nb));
+  return true;
+}
+
+// 先頭から順にレコードを取り出す(壊れていた場合はfalse)
+template <class Func>
+bool
+parse(const Buffer& in, Func func)
+{
+  size_t ofs = 0;
+  while (ofs < in.size())
+  {
+    Record   rec;
+    uint32_t plen;
+    if (!detail::get(in, ofs, plen) || ofs + plen > in.size())
+      return false;
+    rec.path_.assign(&in[ofs], plen);
+    ofs += plen;
+    if (!detail::get(in, ofs, rec.mtime_) || !detail::get(in, ofs, rec.size_) ||
+        ofs + rec.size_ > in.size())
+      return false;
+    rec.data_ = in.data() + ofs;
+    ofs += rec.size_;
+    func(rec);
+  }
+  return true;
+}
+
+} // namespace Bundle
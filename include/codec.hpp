@@ -0,0 +1,158 @@
+//
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <lz4.h>
+#include <lz4hc.h>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <zstd.h>
+
+namespace Codec
+{
+// ブロックごとの圧縮形式(TransHeaderに載る)
+enum class Type : uint8_t
+{
+  None  = 0, // 無圧縮
+  LZ4   = 1,
+  LZ4HC = 2,
+  ZSTD  = 3,
+};
+
+// 接続ごとの圧縮設定
+// levelはLZ4ではacceleration、LZ4HC/ZSTDでは圧縮レベル
+struct Setting
+{
+  Type type_  = Type::LZ4;
+  int  level_ = 1;
+};
+
+// "none", "lz4[:acceleration]", "lz4hc[:level]", "zstd[:level]"
+inline Setting
+parse(const std::string& str)
+{
+  auto    sep  = str.find(':');
+  auto    name = str.substr(0, sep);
+  Setting s;
+  int     level = sep == std::string::npos ? 0 : std::stoi(str.substr(sep + 1));
+  if (name == "none")
+  {
+    s.type_  = Type::None;
+    s.level_ = 0;
+  }
+  else if (name == "lz4")
+  {
+    s.type_  = Type::LZ4;
+    s.level_ = std::min(std::max(level, 1), 65537);
+  }
+  else if (name == "lz4hc")
+  {
+    s.type_  = Type::LZ4HC;
+    s.level_ = level == 0 ? LZ4HC_CLEVEL_DEFAULT
+                          : std::min(std::max(level, 1), LZ4HC_CLEVEL_MAX);
+  }
+  else if (name == "zstd")
+  {
+    s.type_  = Type::ZSTD;
+    s.level_ = level == 0 ? ZSTD_CLEVEL_DEFAULT
+                          : std::min(std::max(level, 1), ZSTD_maxCLevel());
+  }
+  else
+  {
+    throw std::invalid_argument("unknown codec: " + str);
+  }
+  return s;
+}
+
+inline std::string
+toString(const Setting& s)
+{
+  switch (s.type_)
+  {
+  case Type::None:
+    return "none";
+  case Type::LZ4:
+    return "lz4:" + std::to_string(s.level_);
+  case Type::LZ4HC:
+    return "lz4hc:" + std::to_string(s.level_);
+  case Type::ZSTD:
+    return "zstd:" + std::to_string(s.level_);
+  }
+  return "none";
+}
+
+// 圧縮
+// 圧縮しても十分小さくならないブロックはそのまま送る(Type::Noneを返す)
+// 戻り値がNoneの時はdstの内容は不定
+inline Type
+compress(const Setting& s, const char* src, size_t size,
+         std::vector<char>& dst, size_t& comp_size)
+{
+  // 元の97%程度以上なら圧縮する意味がない
+  size_t limit = size - size / 32;
+  int    ret   = 0;
+  switch (s.type_)
+  {
+  case Type::None:
+    return Type::None;
+  case Type::LZ4:
+    dst.resize(LZ4_COMPRESSBOUND(size));
+    ret = LZ4_compress_fast(src, dst.data(), size, dst.size(), s.level_);
+    break;
+  case Type::LZ4HC:
+    dst.resize(LZ4_COMPRESSBOUND(size));
+    ret = LZ4_compress_HC(src, dst.data(), size, dst.size(), s.level_);
+    break;
+  case Type::ZSTD:
+  {
+    static thread_local std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx*)> ctx{
+        ZSTD_createCCtx(), ZSTD_freeCCtx};
+    dst.resize(ZSTD_compressBound(size));
+    auto r = ZSTD_compressCCtx(
+        ctx.get(), dst.data(), dst.size(), src, size, s.level_);
+    ret = ZSTD_isError(r) ? 0 : r;
+    break;
+  }
+  }
+  if (ret <= 0 || size_t(ret) >= limit)
+    return Type::None;
+  comp_size = ret;
+  return s.type_;
+}
+
+// 展開(sizeは展開後のサイズ)
+inline bool
+decompress(Type type, const char* src, size_t comp_size, char* dst,
+           size_t size)
+{
+  switch (type)
+  {
+  case Type::None:
+    if (comp_size != size)
+      return false;
+    std::copy(src, src + size, dst);
+    return true;
+  case Type::LZ4:
+  case Type::LZ4HC:
+    return LZ4_decompress_safe(src, dst, comp_size, size) == int(size);
+  case Type::ZSTD:
+  {
+    static thread_local std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx*)> ctx{
+        ZSTD_createDCtx(), ZSTD_freeDCtx};
+    return ZSTD_decompressDCtx(ctx.get(), dst, size, src, comp_size) == size;
+  }
+  }
+  return false;
+}
+
+// 圧縮後の最大サイズ
+inline size_t
+bound(size_t size)
+{
+  return std::max<size_t>(LZ4_COMPRESSBOUND(size), ZSTD_compressBound(size));
+}
+
+} // namespace Codec
@@ -1,17 +1,35 @@
 //
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/stream.hpp>
+#include <charconv>
+#include <chrono>
+#include <codec.hpp>
+#include <cstring>
+#include <deque>
 #include <fstream>
 #include <functional>
+#include <initializer_list>
 #include <iostream>
-#include <lz4.h>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <queue>
 #include <string>
+#include <string_view>
+#include <threadpool.hpp>
 #include <vector>
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+#endif
 
 namespace Network
 {
@@ -22,130 +40,332 @@ using asio::ip::tcp;
 // 送受信データ
 using Buffer     = std::vector<char>;
 using BufferList = std::vector<std::string>;
+// 受信したメッセージの各要素(受信バッファを指すので、コールバックの中でだけ有効)
+using FieldList = std::vector<std::string_view>;
 // コールバック
 using SendCallback     = std::function<void(bool)>;
-using RecvCallback     = std::function<void(const char*, const BufferList&)>;
-using RecvFileCallback = std::function<void()>;
+using RecvCallback     = std::function<void(const char*, const FieldList&)>;
+// 受信完了(壊れたブロックがあった場合はfalseで、ファイルは消してある)
+using RecvFileCallback   = std::function<void(bool)>;
+using RecvBufferCallback = std::function<void(bool, Buffer&)>;
+
+/// 受信した要素を数値にする(数値でなければ0)
+inline uint64_t
+toNumber(std::string_view field)
+{
+  uint64_t v = 0;
+  std::from_chars(field.data(), field.data() + field.size(), v);
+  return v;
+}
+/// 受信した要素をコールバックの後でも使えるようにコピーする
+inline BufferList
+toList(const FieldList& fields, size_t first = 0)
+{
+  BufferList ret;
+  for (size_t i = first; i < fields.size(); i++)
+    ret.emplace_back(fields[i]);
+  return ret;
+}
 
 // 送受信ヘッダ
 
 // 接続
-class ConnectionBase
+// ハンドラはすべてstrand_上で実行されるので、複数スレッドでio_serviceを回してもよい
+// 非同期処理中はshared_from_this()で自身を保持するため、必ずshared_ptrで生成すること
+class ConnectionBase : public std::enable_shared_from_this<ConnectionBase>
 {
 protected:
-  static constexpr size_t BLOCK_SIZE = 8 * 1024;
-
-  using ReadBlock  = std::array<char, LZ4_COMPRESSBOUND(BLOCK_SIZE)>;
-  using ReadBlocks = std::array<ReadBlock, 2>;
+  // 転送ブロックサイズ(接続時に"hello"で取り決める)
+  static constexpr size_t MIN_BLOCK_SIZE     = 64 * 1024;
+  static constexpr size_t MAX_BLOCK_SIZE     = 4 * 1024 * 1024;
+  static constexpr size_t DEFAULT_BLOCK_SIZE = 1024 * 1024;
+  // 1ファイルあたりの先読み・圧縮中のブロック数上限
+  static constexpr size_t PIPELINE_DEPTH = 8;
+  // 受信済みで書き込み待ちのデータ量上限(超えるとソケットの読み込みを止める)
+  static constexpr size_t RECV_BUFFER_SIZE = 64 * 1024 * 1024;
+  // 可変ブロックサイズ時の1ブロックあたりの目標送信時間
+  static constexpr auto ADAPT_TARGET = std::chrono::milliseconds(20);
+  // 使い回すメッセージの数と、使い回すバッファの大きさの上限
+  static constexpr size_t MESSAGE_POOL_SIZE = 64;
+  static constexpr size_t MESSAGE_POOL_BODY = 64 * 1024;
+  // 続けて送るメッセージを1回の書き込みにまとめる上限
+  static constexpr size_t COALESCE_MESSAGES = 64;
+  static constexpr size_t COALESCE_BYTES    = 256 * 1024;
 
   struct Header
   {
     size_t length_;
-    size_t count_;
+    size_t count_; // 文字列の数(RAW_MESSAGEなら本体はバイナリ1つ)
     char   command_[128];
   };
+  static constexpr size_t RAW_MESSAGE = ~size_t(0);
   struct TransHeader
   {
-    size_t size_;
-    size_t compSize_;
-    bool   eof_;
-    char   p[128 - sizeof(size_t) * 2 - sizeof(bool)];
-  };
-  struct TransBuffer
-  {
-    TransHeader header_;
-    char        body_[LZ4_COMPRESSBOUND(BLOCK_SIZE)];
+    size_t      size_;
+    size_t      compSize_;
+    uint64_t    offset_; // ファイル中の位置
+    uint32_t    stream_; // ファイル識別番号(要求側が割り当てる)
+    bool        eof_;
+    Codec::Type codec_; // このブロックの圧縮形式
+    char        p[128 - sizeof(size_t) * 2 - sizeof(uint64_t) -
+                  sizeof(uint32_t) - sizeof(bool) - sizeof(Codec::Type)];
   };
   struct SendInfoBase
   {
     Header       header_;
     SendCallback callback_;
+    const bool   is_file_; // SendFileInfoならtrue
+    // 送信待ちスタック(send_head_)に積まれている間だけ使う
+    SendInfoBase*                 next_ = nullptr;
+    std::shared_ptr<SendInfoBase> hold_; // 積まれている間は自身を保持する
+    SendInfoBase(bool is_file) : is_file_(is_file) {}
     virtual ~SendInfoBase() = default;
   };
+  // 通常のメッセージ(送信後はmsg_pool_に戻してバッファごと使い回す)
   struct SendInfo : public SendInfoBase
   {
     Buffer body_;
+    SendInfo() : SendInfoBase(false) {}
   };
+  using SendInfoMsgPtr = std::shared_ptr<SendInfo>;
+  // ファイル送信は 読み込み -> 圧縮(ワーカープール) -> 順番通りに書き込み
+  // の段階に分かれ、最大PIPELINE_DEPTHブロックが同時に処理される
+  struct SendBlock
+  {
+    static constexpr size_t NONE = ~size_t(0);
+
+    size_t      seq_;
+    TransHeader header_;
+    Buffer      raw_;
+    Buffer      body_;
+  };
+  using SendBlockPtr = std::shared_ptr<SendBlock>;
   struct SendFileInfo : public SendInfoBase
   {
-    std::ifstream infile_;
-    TransBuffer   buffer_;
-    ReadBlocks    read_buffer_;
-    int           read_index_;
-    size_t        trans_;
+    using Clock = std::chrono::steady_clock;
+
+    SendFileInfo() : SendInfoBase(true) {}
+
+    using MemoryStream = boost::iostreams::stream<boost::iostreams::array_source>;
+
+    // 読み込み段(ワーカースレッド、read_lock_で保護)
+    // 送信元はファイル(infile_)かメモリ(memory_)
+    std::mutex                    read_lock_;
+    std::ifstream                 infile_;
+    Buffer                        memory_;
+    std::unique_ptr<MemoryStream> memstream_;
+    std::istream*                 input_;
+    size_t                        trans_;
+    uint64_t                      read_pos_;
+    size_t        read_seq_;
+    bool          read_eof_;
+    // 書き込み段(strand_上のみ)
+    uint32_t                       stream_;
+    size_t                         block_size_;
+    size_t                         issued_;
+    size_t                         write_seq_;
+    bool                           read_done_;
+    bool                           writing_;
+    bool                           failed_;
+    Clock::time_point              write_start_;
+    std::map<size_t, SendBlockPtr> ready_;
+#if defined(__linux__)
+    // 無圧縮時はsendfile(2)でページキャッシュから直接送る
+    int         fd_     = -1;
+    off_t       offset_ = 0;
+    TransHeader zc_header_;
+    ~SendFileInfo()
+    {
+      if (fd_ >= 0)
+        ::close(fd_);
+    }
+#endif
   };
-  using SendInfoPtr = std::shared_ptr<SendInfoBase>;
-  using SendQueue   = std::queue<SendInfoPtr>;
+  using SendFileInfoPtr = std::shared_ptr<SendFileInfo>;
+  using SendInfoPtr     = std::shared_ptr<SendInfoBase>;
+  using SendQueue       = std::deque<SendInfoPtr>;
 
+  // ファイル受信は ソケット読み込み(strand_) -> 展開・書き込み(ワーカープール)
+  // の2段で行い、書き込みを待たずに次のブロックを読み込む
+  struct RecvBlock
+  {
+    TransHeader header_;
+    Buffer      body_;
+    Buffer      data_;
+  };
+  using RecvBlockPtr = std::shared_ptr<RecvBlock>;
+  // 受信先はファイル(ofs_)かメモリ(memory_)
   struct ReadFileInfo
   {
-    std::string      filename_;
-    std::ofstream    ofs_;
-    RecvFileCallback callback_;
+    std::string              filename_;
+    std::fstream             ofs_;
+    uint64_t                 write_pos_;
+    Buffer                   memory_;
+    RecvFileCallback         callback_;
+    RecvBufferCallback       buffer_callback_;
+    std::mutex               lock_;
+    std::queue<RecvBlockPtr> blocks_;
+    bool                     writing_;
+    bool                     failed_; // 壊れたブロックがあった
+    // 既存のファイルは切り詰めずに開く(続きから受信する場合のため)
     ReadFileInfo(std::string fn, RecvFileCallback cb)
-        : filename_(fn), ofs_(fn, std::ios::binary), callback_(cb)
+        : filename_(fn), write_pos_(0), callback_(cb), writing_(false),
+          failed_(false)
+    {
+      auto mode = std::ios::binary | std::ios::in | std::ios::out;
+      ofs_.open(fn, mode);
+      if (!ofs_.is_open())
+        ofs_.open(fn, mode | std::ios::trunc);
+    }
+    ReadFileInfo(RecvBufferCallback cb)
+        : filename_("(memory)"), write_pos_(0), buffer_callback_(cb),
+          writing_(false), failed_(false)
+    {
+    }
+    void write(const char* data, size_t size, uint64_t offset)
+    {
+      if (buffer_callback_)
+      {
+        memory_.insert(memory_.end(), data, data + size);
+        return;
+      }
+      if (offset != write_pos_)
+        ofs_.seekp(offset);
+      ofs_.write(data, size);
+      write_pos_ = offset + size;
+    }
+    // 受信完了(以前の内容の方が長ければ切り詰める)
+    // 壊れたブロックがあった場合は途中までの内容を残さない
+    void close()
     {
+      if (failed_)
+        memory_.clear();
+      if (!ofs_.is_open())
+        return;
+      ofs_.close();
+      boost::system::error_code err;
+      if (failed_)
+        fs::remove(filename_, err);
+      else if (fs::file_size(filename_, err) > write_pos_)
+        fs::resize_file(filename_, write_pos_, err);
     }
   };
   using ReadFileInfoPtr = std::shared_ptr<ReadFileInfo>;
+  using ReadFileMap     = std::map<uint32_t, ReadFileInfoPtr>;
 
-  asio::io_service& io_service_;
-  tcp::socket       socket_;
-  Header            read_header_;
-  Buffer            read_buffer_;
-  RecvCallback      read_callback_;
-  SendQueue         send_que_;
-  std::mutex        que_lock_;
-  ReadFileInfoPtr   read_file_info_;
+  asio::io_service&         io_service_;
+  asio::io_service::strand  strand_;
+  tcp::socket               socket_;
+  Header                    read_header_;
+  Buffer                    read_buffer_;
+  FieldList                 read_fields_;
+  RecvCallback              read_callback_;
+  SendQueue                 send_que_; // 送信順に並べたもの(strand_上のみ)
+  ReadFileMap               read_files_;
+  std::mutex                file_lock_;
+  RecvBlockPtr              recv_block_;
+  std::vector<RecvBlockPtr> recv_free_;
+  size_t                    recv_pending_ = 0;
+  bool                      recv_paused_  = false;
+  bool                      recv_eof_     = false;
+  size_t                    block_size_   = MIN_BLOCK_SIZE;
+  bool                      adaptive_     = false;
+  Codec::Setting            codec_;
+  // 送信を終えたメッセージ(send()はどのスレッドからも呼ばれる)
+  std::vector<SendInfoMsgPtr> msg_pool_;
+  std::mutex                  pool_lock_;
+  // 送信待ち(どのスレッドからも積めるロックなしのスタック、新しいものが先頭)
+  std::atomic<SendInfoBase*> send_head_{nullptr};
+  std::atomic_bool           sending_{false}; // send_loop()が動いている
+  // 書き込み中のメッセージ数とバッファ(strand_上のみ)
+  size_t                          write_count_ = 0;
+  std::vector<asio::const_buffer> write_buffers_;
 
 public:
   ConnectionBase(asio::io_service& io_service)
-      : io_service_(io_service), socket_(io_service)
+      : io_service_(io_service), strand_(io_service), socket_(io_service)
   {
   }
+  virtual ~ConnectionBase() = default;
 
-  /// 通常のメッセージ送信
-  void send(const char* cmd, BufferList buff_list, SendCallback cb)
+  tcp::socket& socket() { return socket_; }
+
+  /// 転送ブロックサイズの設定(範囲外の値は丸める)
+  /// adaptiveなら送信中に送信速度に合わせてブロックサイズを増減する
+  size_t setBlockSize(size_t size, bool adaptive)
   {
-    auto  info      = std::make_shared<SendInfo>();
-    auto& header    = info->header_;
-    auto& buffer    = info->body_;
-    info->callback_ = cb;
+    block_size_ = std::min(std::max(size, MIN_BLOCK_SIZE), MAX_BLOCK_SIZE);
+    adaptive_   = adaptive;
+    return block_size_;
+  }
+  /// 送信時の圧縮形式
+  void setCodec(Codec::Setting codec) { codec_ = codec; }
+
+  /// 通常のメッセージ送信(各要素はNUL区切りで送る)
+  void send(const char* cmd, std::initializer_list<std::string_view> fields,
+            SendCallback cb)
+  {
+    send_fields(cmd, fields.begin(), fields.end(), std::move(cb));
+  }
+  void send(const char* cmd, const BufferList& fields, SendCallback cb)
+  {
+    send_fields(cmd, fields.begin(), fields.end(), std::move(cb));
+  }
+  /// バイナリのメッセージ送信(受信側にはFieldListの1要素として渡る)
+  void sendRaw(const char* cmd, Buffer data, SendCallback cb)
+  {
+    auto info      = alloc_message(cmd, std::move(cb));
+    info->body_    = std::move(data);
+    auto& header   = info->header_;
+    header.length_ = info->body_.size();
+    header.count_  = RAW_MESSAGE;
 
-    int total_size = 0;
-    for (auto& b : buff_list)
+    req_send(info);
+  }
+  /// ファイル送信(streamは受信側で転送ブロックの振り分けに使う)
+  /// offsetを指定するとファイルの途中から送る
+  void sendFile(std::string fname, uint32_t stream, SendCallback cb,
+                uint64_t offset = 0)
+  {
+    auto info       = std::make_shared<SendFileInfo>();
+    info->callback_ = cb;
+#if defined(__linux__)
+    if (codec_.type_ == Codec::Type::None)
+      info->fd_ = ::open(fname.c_str(), O_RDONLY | O_CLOEXEC);
+    if (info->fd_ < 0)
+#endif
+      info->infile_.open(fname, std::ios::binary);
+    info->input_ = &info->infile_;
+    // 要求までの間に消えたファイルは空として送る(受信側を待たせない)
+    boost::system::error_code err;
+    info->trans_ = fs::file_size(fname, err);
+    if (err)
     {
-      total_size += b.size() + 1;
+      std::cerr << "file not found: " << fname << std::endl;
+      info->trans_ = 0;
     }
-    buffer.resize(total_size);
-    int ofs = 0;
-    for (auto& b : buff_list)
+    offset       = std::min<uint64_t>(offset, info->trans_);
+    if (offset > 0)
     {
-      int n = b.size() + 1;
-      strncpy(&buffer[ofs], b.c_str(), n);
-      ofs += n;
+      info->infile_.seekg(offset);
+      info->trans_ -= offset;
     }
-    strncpy(header.command_, cmd, sizeof(header.command_));
-    header.length_ = buffer.size();
-    header.count_  = buff_list.size();
-
-    req_send(info);
+#if defined(__linux__)
+    info->offset_ = offset;
+#endif
+    start_send_file(info, stream, offset);
   }
-  /// ファイル送信
-  void sendFile(std::string fname, SendCallback cb)
+  /// メモリ上のデータをファイルと同じ形式で送信
+  void sendBuffer(Buffer data, uint32_t stream, SendCallback cb)
   {
-    auto  info      = std::make_shared<SendFileInfo>();
-    auto& header    = info->header_;
-    info->callback_ = cb;
-    info->infile_.open(fname, std::ios::binary);
-    info->trans_      = fs::file_size(fname);
-    info->read_index_ = 0;
-
-    strncpy(header.command_, "filecopy", sizeof(header.command_));
-    header.length_ = info->trans_;
-    header.count_  = 1;
-
-    req_send(info);
+    auto info        = std::make_shared<SendFileInfo>();
+    info->callback_  = cb;
+    info->memory_    = std::move(data);
+    info->memstream_ = std::make_unique<SendFileInfo::MemoryStream>(
+        info->memory_.data(), info->memory_.size());
+    info->input_ = info->memstream_.get();
+    info->trans_ = info->memory_.size();
+    start_send_file(info, stream, 0);
   }
 
   /// メッセージ受信
@@ -155,58 +375,175 @@ public:
     boost::asio::async_read(
         socket_,
         asio::buffer(&read_header_, sizeof(read_header_)),
-        [&](auto& err, auto bytes) { on_header_receive(err, bytes); });
+        asio::bind_executor(strand_,
+                            [this, self = shared_from_this()](auto& err,
+                                                              auto  bytes) {
+                              on_header_receive(err, bytes);
+                            }));
   }
-  /// ファイル受信
-  void start_receive(std::string fname, RecvFileCallback cb)
+  /// ファイル受信の登録
+  /// 受信自体はstart_receive()のループ内で"filecopy"を受けた時に行われる
+  /// resumeなら既存のファイルを残し、送られてきた位置に書き込む
+  void receiveFile(uint32_t stream, std::string fname, RecvFileCallback cb,
+                   bool resume = false)
   {
     fs::path fullpath{fname};
     if (fs::exists(fullpath))
     {
-      fs::remove(fullpath);
+      if (!resume)
+        fs::remove(fullpath);
     }
     else
     {
       fs::create_directories(fullpath.parent_path());
     }
-    read_file_info_ = std::make_shared<ReadFileInfo>(fname, cb);
-    read_buffer_.resize(sizeof(TransBuffer));
-    boost::asio::async_read(
-        socket_,
-        asio::buffer(&read_header_, sizeof(read_header_)),
-        [&](auto& err, auto bytes) { on_file_receive(err, bytes); });
+    std::lock_guard<std::mutex> l(file_lock_);
+    read_files_[stream] = std::make_shared<ReadFileInfo>(fname, cb);
+  }
+  /// メモリへの受信の登録(sendBuffer()の受け側)
+  void receiveBuffer(uint32_t stream, RecvBufferCallback cb)
+  {
+    std::lock_guard<std::mutex> l(file_lock_);
+    read_files_[stream] = std::make_shared<ReadFileInfo>(cb);
   }
 
 private:
+  // 送信するメッセージ(使い回せるものがあれば使う)
+  // 他のスレッドがプールを使っている間は待たずに新しく作る
+  SendInfoMsgPtr alloc_message(const char* cmd, SendCallback cb)
+  {
+    SendInfoMsgPtr info;
+    {
+      std::unique_lock<std::mutex> l(pool_lock_, std::try_to_lock);
+      if (l && !msg_pool_.empty())
+      {
+        info = std::move(msg_pool_.back());
+        msg_pool_.pop_back();
+      }
+    }
+    if (!info)
+      info = std::make_shared<SendInfo>();
+    info->callback_ = std::move(cb);
+    strncpy(info->header_.command_, cmd, sizeof(info->header_.command_));
+    return info;
+  }
+  // 送信を終えたメッセージを戻す(大きいバッファは手放す)
+  void free_message(SendInfoMsgPtr info)
+  {
+    info->callback_ = nullptr;
+    if (info->body_.capacity() > MESSAGE_POOL_BODY)
+      Buffer{}.swap(info->body_);
+    std::unique_lock<std::mutex> l(pool_lock_, std::try_to_lock);
+    if (l && msg_pool_.size() < MESSAGE_POOL_SIZE)
+      msg_pool_.push_back(std::move(info));
+  }
+  template <class Iter>
+  void send_fields(const char* cmd, Iter first, Iter last, SendCallback cb)
+  {
+    auto   info  = alloc_message(cmd, std::move(cb));
+    auto&  body  = info->body_;
+    size_t total = 0;
+    for (auto it = first; it != last; ++it)
+      total += std::string_view(*it).size() + 1;
+    body.resize(total);
+    auto p = body.data();
+    for (auto it = first; it != last; ++it)
+    {
+      std::string_view f(*it);
+      std::memcpy(p, f.data(), f.size());
+      p += f.size();
+      *p++ = '\0';
+    }
+    info->header_.length_ = total;
+    info->header_.count_  = std::distance(first, last);
+
+    req_send(info);
+  }
+
+  void start_send_file(SendFileInfoPtr info, uint32_t stream, uint64_t offset)
+  {
+    auto& header      = info->header_;
+    info->read_pos_   = offset;
+    info->read_seq_   = 0;
+    info->read_eof_   = false;
+    info->stream_     = stream;
+    info->block_size_ = adaptive_ ? MIN_BLOCK_SIZE : block_size_;
+    info->issued_     = 0;
+    info->write_seq_  = 0;
+    info->read_done_  = false;
+    info->writing_    = false;
+    info->failed_     = false;
+
+    strncpy(header.command_, "filecopy", sizeof(header.command_));
+    header.length_ = info->trans_;
+    header.count_  = 1;
+
+    req_send(info);
+  }
+  // 送信待ちに積む(ロックは取らない)
+  // send_loop()が動いていなければ起こす
   void req_send(SendInfoPtr info)
   {
-    bool launch;
+    auto raw   = info.get();
+    raw->hold_ = std::move(info);
+    auto head  = send_head_.load(std::memory_order_relaxed);
+    do
+    {
+      raw->next_ = head;
+    } while (!send_head_.compare_exchange_weak(
+        head, raw, std::memory_order_release, std::memory_order_relaxed));
+    if (!sending_.exchange(true))
+    {
+      asio::post(strand_, [this, self = shared_from_this()]() { send_loop(); });
+    }
+  }
+  // 積まれた分をまとめて取り出し、積まれた順にsend_que_に加える
+  void take_requests()
+  {
+    SendInfoBase* head = send_head_.exchange(nullptr);
+    SendInfoBase* list = nullptr;
+    while (head)
     {
-      std::lock_guard<std::mutex> l(que_lock_);
-      launch = send_que_.empty();
-      send_que_.push(info);
+      auto next   = head->next_;
+      head->next_ = list;
+      list        = head;
+      head        = next;
     }
-    if (launch)
+    while (list)
     {
-      io_service_.post([this]() { send_loop(); });
+      auto next = list->next_;
+      send_que_.push_back(std::move(list->hold_));
+      list = next;
     }
   }
 
   // メッセージ受信
   void on_header_receive(const boost::system::error_code& error, size_t bytes)
   {
-    if (error && error != boost::asio::error::eof)
+    if (error)
     {
-      std::cout << "receive header failed: " << error.message() << std::endl;
+      if (error != boost::asio::error::eof)
+        std::cout << "receive header failed: " << error.message() << std::endl;
       read_callback_("error", {});
     }
+    else if (strncmp(read_header_.command_,
+                     "filecopy",
+                     sizeof(read_header_.command_)) == 0)
+    {
+      // ファイル転送はコールバックを呼ばずにここで受け取る
+      on_file_receive(error, bytes);
+    }
     else
     {
       read_buffer_.resize(read_header_.length_);
       boost::asio::async_read(
-          socket_, asio::buffer(read_buffer_), [&](auto& err, auto bytes) {
-            on_receive(err, bytes);
-          });
+          socket_,
+          asio::buffer(read_buffer_),
+          asio::bind_executor(
+              strand_,
+              [this, self = shared_from_this()](auto& err, auto bytes) {
+                on_receive(err, bytes);
+              }));
     }
   }
   void on_receive(const boost::system::error_code& error, size_t bytes)
@@ -218,72 +555,254 @@ private:
     }
     else
     {
-      int        ofs = 0;
-      BufferList ret;
-      for (int i = 0; i < read_header_.count_; i++)
+      // 受信バッファを指すだけで、要素ごとのコピーはしない
+      auto& fields = read_fields_;
+      fields.clear();
+      if (read_header_.count_ == RAW_MESSAGE)
+      {
+        fields.emplace_back(read_buffer_.data(), read_buffer_.size());
+      }
+      else
       {
-        ret.push_back(&read_buffer_[ofs]);
-        ofs += strlen(&read_buffer_[ofs]) + 1;
+        auto p   = read_buffer_.data();
+        auto end = p + read_buffer_.size();
+        for (size_t i = 0; i < read_header_.count_ && p < end; i++)
+        {
+          auto nul = static_cast<const char*>(std::memchr(p, 0, end - p));
+          auto len = nul ? size_t(nul - p) : size_t(end - p);
+          fields.emplace_back(p, len);
+          p += len + 1;
+        }
       }
-      read_callback_(read_header_.command_, ret);
+      read_header_.command_[sizeof(read_header_.command_) - 1] = '\0';
+      read_callback_(read_header_.command_, fields);
     }
   }
   // ファイル受信
+  ReadFileInfoPtr find_file(uint32_t stream)
+  {
+    std::lock_guard<std::mutex> l(file_lock_);
+    auto                        it = read_files_.find(stream);
+    return it != read_files_.end() ? it->second : ReadFileInfoPtr{};
+  }
   void on_file_receive(const boost::system::error_code& error, size_t bytes)
   {
-    if (error && error != boost::asio::error::eof)
+    if (recv_free_.empty())
     {
-      std::cout << "receive header failed: " << error.message() << std::endl;
-      read_file_info_->callback_();
+      recv_block_ = std::make_shared<RecvBlock>();
     }
     else
     {
-      // パケットヘッダ
-      read_buffer_.resize(sizeof(TransHeader));
-      asio::async_read(
-          socket_, asio::buffer(read_buffer_), [&](auto& err, auto bytes) {
-            const TransHeader* header =
-                reinterpret_cast<const TransHeader*>(read_buffer_.data());
-            ReadBlock body;
-            asio::read(socket_, asio::buffer(body.data(), header->compSize_));
-            ReadBlock buff;
-            int       decSize = LZ4_decompress_safe(
-                body.data(), buff.data(), header->compSize_, BLOCK_SIZE);
-            auto& ofs = read_file_info_->ofs_;
-            ofs.write(buff.data(), header->size_);
-            if (header->eof_)
-            {
-              ofs.close();
-              read_file_info_->callback_();
-            }
-            else
-            {
-              // continue
-              on_file_receive(err, bytes);
-            }
-          });
+      recv_block_ = recv_free_.back();
+      recv_free_.pop_back();
     }
+    // パケットヘッダ
+    asio::async_read(
+        socket_,
+        asio::buffer(&recv_block_->header_, sizeof(TransHeader)),
+        asio::bind_executor(strand_, [this, self = shared_from_this()](
+                                         auto& err, auto bytes) {
+          auto& header = recv_block_->header_;
+          if (err || header.size_ > MAX_BLOCK_SIZE ||
+              header.compSize_ > Codec::bound(MAX_BLOCK_SIZE))
+          {
+            std::cout << "receive block failed: "
+                      << (err ? err.message() : "invalid block size")
+                      << std::endl;
+            read_callback_("error", {});
+            return;
+          }
+          recv_block_->body_.resize(header.compSize_);
+          asio::async_read(
+              socket_,
+              asio::buffer(recv_block_->body_),
+              asio::bind_executor(strand_,
+                                  [this, self](auto& err, auto bytes) {
+                                    on_block_receive(err, bytes);
+                                  }));
+        }));
   }
+  void on_block_receive(const boost::system::error_code& error, size_t bytes)
+  {
+    if (error)
+    {
+      std::cout << "receive block failed: " << error.message() << std::endl;
+      read_callback_("error", {});
+      return;
+    }
+    auto block = std::move(recv_block_);
+    bool eof   = block->header_.eof_;
+    if (auto info = find_file(block->header_.stream_))
+    {
+      if (eof)
+      {
+        std::lock_guard<std::mutex> l(file_lock_);
+        read_files_.erase(block->header_.stream_);
+      }
+      bool launch;
+      {
+        std::lock_guard<std::mutex> l(info->lock_);
+        info->blocks_.push(block);
+        launch         = !info->writing_;
+        info->writing_ = true;
+      }
+      if (launch)
+      {
+        Concurrent::ThreadPool::shared().post(
+            [this, self = shared_from_this(), info]() { write_blocks(info); });
+      }
+      recv_pending_ += block->header_.size_ + block->header_.compSize_;
+    }
+    else
+    {
+      recv_free_.push_back(block);
+    }
 
-  //
-  void send_loop()
+    if (recv_pending_ >= RECV_BUFFER_SIZE)
+    {
+      // 書き込みが追い付くまで待つ
+      recv_paused_ = true;
+      recv_eof_    = eof;
+    }
+    else
+    {
+      continue_receive(eof);
+    }
+  }
+  void continue_receive(bool eof)
   {
-    SendInfoPtr info;
+    if (eof)
+    {
+      // 次のメッセージへ
+      start_receive(read_callback_);
+    }
+    else
     {
-      std::lock_guard<std::mutex> l(que_lock_);
-      if (!send_que_.empty())
+      // continue
+      on_file_receive({}, 0);
+    }
+  }
+  // 展開・書き込み(ワーカースレッド)
+  void write_blocks(ReadFileInfoPtr info)
+  {
+    for (;;)
+    {
+      RecvBlockPtr block;
+      {
+        std::lock_guard<std::mutex> l(info->lock_);
+        if (info->blocks_.empty())
+        {
+          info->writing_ = false;
+          break;
+        }
+        block = info->blocks_.front();
+        info->blocks_.pop();
+      }
+      auto& header = block->header_;
+      auto* data   = block->body_.data();
+      if (info->failed_)
+      {
+        // 壊れた後のブロックは捨てる
+      }
+      else if (header.codec_ != Codec::Type::None)
+      {
+        block->data_.resize(header.size_);
+        data = block->data_.data();
+        if (!Codec::decompress(header.codec_,
+                               block->body_.data(),
+                               header.compSize_,
+                               data,
+                               header.size_))
+        {
+          std::cerr << "decompress failed: " << info->filename_ << std::endl;
+          info->failed_ = true;
+        }
+      }
+      else if (header.compSize_ != header.size_)
+      {
+        std::cerr << "invalid block: " << info->filename_ << std::endl;
+        info->failed_ = true;
+      }
+      if (!info->failed_)
+        info->write(data, header.size_, header.offset_);
+      bool eof = header.eof_;
+      if (eof)
       {
-        info = send_que_.front();
+        info->close();
       }
+      asio::post(strand_, [this, self = shared_from_this(), info, block, eof]() {
+        on_block_written(info, block, eof);
+      });
+    }
+  }
+  void on_block_written(ReadFileInfoPtr info, RecvBlockPtr block, bool eof)
+  {
+    recv_pending_ -= block->header_.size_ + block->header_.compSize_;
+    recv_free_.push_back(block);
+    if (eof)
+    {
+      if (info->buffer_callback_)
+        info->buffer_callback_(!info->failed_, info->memory_);
+      else
+        info->callback_(!info->failed_);
     }
+    if (recv_paused_ && recv_pending_ < RECV_BUFFER_SIZE / 2)
+    {
+      recv_paused_ = false;
+      continue_receive(recv_eof_);
+    }
+  }
 
-    // ヘッダ転送(共通)
+  // 送信待ちの先頭から送る(strand_上で、前の送信が終わってから呼ぶ)
+  void send_loop()
+  {
+    take_requests();
+    if (send_que_.empty())
+    {
+      // 止める前に積まれた分があれば続ける(起こされずに残るものを作らない)
+      sending_ = false;
+      if (!send_head_.load() || sending_.exchange(true))
+        return;
+      take_requests();
+    }
+
+    auto info = send_que_.front();
+    if (!info->is_file_)
+    {
+      // 続くメッセージもまとめて、ヘッダと本体を1回で書き込む
+      write_buffers_.clear();
+      size_t bytes = 0;
+      for (write_count_ = 0; write_count_ < send_que_.size() &&
+                             write_count_ < COALESCE_MESSAGES &&
+                             bytes < COALESCE_BYTES;
+           write_count_++)
+      {
+        auto& m = *send_que_[write_count_];
+        if (m.is_file_)
+          break;
+        auto& body = static_cast<SendInfo&>(m).body_;
+        write_buffers_.push_back(asio::buffer(&m.header_, sizeof(Header)));
+        write_buffers_.push_back(asio::buffer(body));
+        bytes += sizeof(Header) + body.size();
+      }
+      asio::async_write(
+          socket_,
+          write_buffers_,
+          asio::bind_executor(
+              strand_, [this, self = shared_from_this()](auto& err, auto) {
+                on_send_messages(err);
+              }));
+      return;
+    }
+    // ファイルはヘッダを送ってからブロックを送る
     auto& header = info->header_;
     asio::async_write(socket_,
                       asio::buffer(&header, sizeof(header)),
-                      [this, info](auto& err, auto bytes) {
-                        on_send_header(info, err, bytes);
-                      });
+                      asio::bind_executor(strand_,
+                                          [this, self = shared_from_this(),
+                                           info](auto& err, auto bytes) {
+                                            on_send_header(info, err, bytes);
+                                          }));
   }
   //
   void on_send_header(SendInfoPtr info, const boost::system::error_code& error,
@@ -292,73 +811,255 @@ private:
     if (error)
     {
       std::cerr << "error[send header]: " << error.message() << std::endl;
-      info->callback_(false);
+      complete_send(info, false);
     }
-    else if (auto minfo = std::dynamic_pointer_cast<SendInfo>(info))
-    {
-      // メッセージ送信
-      auto& buffer = minfo->body_;
-      asio::async_write(
-          socket_, asio::buffer(buffer), [this, info](auto& err, auto bytes) {
-            on_send(info, err, bytes);
-          });
-    }
-    else if (auto minfo = std::dynamic_pointer_cast<SendFileInfo>(info))
+    else
     {
       // ファイル送信
-      auto& ifs         = minfo->infile_;
-      auto& buff        = minfo->buffer_;
-      auto& header      = buff.header_;
-      int   page        = minfo->read_index_;
-      auto& temp_buffer = minfo->read_buffer_[page];
-      ifs.read(temp_buffer.data(), BLOCK_SIZE);
-      minfo->read_index_ = (minfo->read_index_ + 1) % 2;
-      auto readSize      = ifs.gcount();
-      int  compSize      = LZ4_compress_default(
-          temp_buffer.data(), buff.body_, readSize, sizeof(buff.body_));
-      header.size_     = readSize;
-      header.eof_      = ifs.eof();
-      header.compSize_ = compSize;
-      minfo->trans_ -= header.size_;
-      size_t send_size = sizeof(header) + compSize;
-      asio::async_write(socket_,
-                        asio::buffer(&buff, send_size),
-                        [this, minfo](auto& err, auto bytes) {
-                          auto& h = minfo->buffer_.header_;
-                          if (h.eof_)
-                          {
-                            on_send(minfo, err, bytes);
-                            std::cout << "file size: " << minfo->header_.length_
-                                      << std::endl;
-                          }
-                          else
-                          {
-                            on_send_header(minfo, err, bytes);
-                          }
-                        });
+      auto minfo = std::static_pointer_cast<SendFileInfo>(info);
+#if defined(__linux__)
+      if (minfo->fd_ >= 0)
+      {
+        send_zero_copy(minfo);
+        return;
+      }
+#endif
+      fill_pipeline(minfo, nullptr);
     }
   }
-  void on_send(SendInfoPtr info, const boost::system::error_code& error,
-               size_t bytes)
+#if defined(__linux__)
+  // 無圧縮ブロックのヘッダを送り、本体はsendfileで送る
+  void send_zero_copy(SendFileInfoPtr minfo)
   {
-    if (error)
+    auto& header     = minfo->zc_header_;
+    header.size_     = std::min(minfo->trans_, minfo->block_size_);
+    header.compSize_ = header.size_;
+    header.offset_   = minfo->offset_;
+    header.stream_   = minfo->stream_;
+    header.codec_    = Codec::Type::None;
+    header.eof_      = header.size_ == minfo->trans_;
+    minfo->trans_ -= header.size_;
+    // 通常のブロックと同じく送信時間でブロックサイズを調整する
+    minfo->write_start_ = SendFileInfo::Clock::now();
+    asio::async_write(
+        socket_,
+        asio::buffer(&header, sizeof(header)),
+        asio::bind_executor(
+            strand_,
+            [this, self = shared_from_this(), minfo](auto& err, auto bytes) {
+              if (err)
+                on_send(minfo, err, bytes);
+              else
+                send_zero_copy_body(minfo, minfo->zc_header_.size_);
+            }));
+  }
+  void send_zero_copy_body(SendFileInfoPtr minfo, size_t remain)
+  {
+    if (!socket_.native_non_blocking())
+      socket_.native_non_blocking(true);
+    while (remain > 0)
     {
-      std::cerr << "error[send body]: " << error.message() << std::endl;
-      info->callback_(false);
+      auto n = ::sendfile(
+          socket_.native_handle(), minfo->fd_, &minfo->offset_, remain);
+      if (n > 0)
+      {
+        remain -= n;
+      }
+      else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      {
+        // 送信バッファが空くまで待つ
+        socket_.async_wait(
+            tcp::socket::wait_write,
+            asio::bind_executor(strand_,
+                                [this, self = shared_from_this(), minfo,
+                                 remain](auto& err) {
+                                  if (err)
+                                    on_send(minfo, err, 0);
+                                  else
+                                    send_zero_copy_body(minfo, remain);
+                                }));
+        return;
+      }
+      else
+      {
+        // 途中でファイルが縮んだ場合はブロックを埋められないので切断する
+        boost::system::error_code err =
+            n < 0 ? boost::system::error_code(errno,
+                                              boost::system::system_category())
+                  : asio::error::eof;
+        socket_.close();
+        on_send(minfo, err, 0);
+        return;
+      }
+    }
+    adapt_block_size(minfo, minfo->zc_header_.size_);
+    if (minfo->zc_header_.eof_)
+    {
+      on_send(minfo, {}, 0);
+      std::cout << "file size: " << minfo->header_.length_ << std::endl;
     }
     else
     {
-      info->callback_(true);
+      send_zero_copy(minfo);
     }
+  }
+#endif
+  // 先読み数に空きがあればブロックの読み込みと圧縮をワーカーに依頼
+  void fill_pipeline(SendFileInfoPtr minfo, SendBlockPtr block)
+  {
+    while (!minfo->read_done_ &&
+           minfo->issued_ - minfo->write_seq_ < PIPELINE_DEPTH)
     {
-      std::lock_guard<std::mutex> l(que_lock_);
-      send_que_.pop();
-      if (!send_que_.empty())
-      {
-        io_service_.post([this]() { send_loop(); });
-      }
+      if (!block)
+        block = std::make_shared<SendBlock>();
+      issue_block(minfo, block, minfo->block_size_);
+      block.reset();
     }
   }
+  void issue_block(SendFileInfoPtr minfo, SendBlockPtr block, size_t bsize)
+  {
+    minfo->issued_++;
+    Concurrent::ThreadPool::shared().post(
+        [this, self = shared_from_this(), minfo, block, bsize]() {
+          auto& header = block->header_;
+          {
+            // 読み込みはファイル先頭から順に行う
+            std::lock_guard<std::mutex> l(minfo->read_lock_);
+            if (minfo->read_eof_)
+            {
+              // 既に最終ブロックを読み終えていた
+              block->seq_ = SendBlock::NONE;
+            }
+            else
+            {
+              auto& ifs   = *minfo->input_;
+              auto  rsize = std::min(minfo->trans_, bsize);
+              block->raw_.resize(rsize);
+              ifs.read(block->raw_.data(), rsize);
+              block->seq_    = minfo->read_seq_++;
+              header.size_   = ifs.gcount();
+              header.offset_ = minfo->read_pos_;
+              minfo->read_pos_ += header.size_;
+              // 途中でファイルが縮んだ場合もそこで終わりにする
+              minfo->trans_ =
+                  header.size_ < rsize ? 0 : minfo->trans_ - header.size_;
+              header.eof_      = minfo->trans_ == 0;
+              minfo->read_eof_ = header.eof_;
+            }
+          }
+          if (block->seq_ != SendBlock::NONE)
+          {
+            header.codec_ = Codec::compress(
+                codec_, block->raw_.data(), header.size_, block->body_,
+                header.compSize_);
+            if (header.codec_ == Codec::Type::None)
+            {
+              // 圧縮が効かないブロックはそのまま送る
+              std::swap(block->raw_, block->body_);
+              header.compSize_ = header.size_;
+            }
+            header.stream_ = minfo->stream_;
+          }
+          asio::post(strand_, [this, self, minfo, block]() {
+            if (block->seq_ == SendBlock::NONE)
+            {
+              minfo->issued_--;
+              return;
+            }
+            if (block->header_.eof_)
+              minfo->read_done_ = true;
+            minfo->ready_[block->seq_] = block;
+            write_block(minfo);
+          });
+        });
+  }
+  // 圧縮済みのブロックを順番通りに送信
+  void write_block(SendFileInfoPtr minfo)
+  {
+    if (minfo->writing_ || minfo->failed_)
+      return;
+    auto it = minfo->ready_.find(minfo->write_seq_);
+    if (it == minfo->ready_.end())
+      return;
+    auto block = it->second;
+    minfo->ready_.erase(it);
+    minfo->writing_     = true;
+    minfo->write_start_ = SendFileInfo::Clock::now();
+    std::array<asio::const_buffer, 2> buffers{
+        asio::buffer(&block->header_, sizeof(TransHeader)),
+        asio::buffer(block->body_.data(), block->header_.compSize_)};
+    asio::async_write(
+        socket_,
+        buffers,
+        asio::bind_executor(strand_,
+                            [this, self = shared_from_this(), minfo, block](
+                                auto& err, auto bytes) {
+                              on_send_block(minfo, block, err, bytes);
+                            }));
+  }
+  void on_send_block(SendFileInfoPtr minfo, SendBlockPtr block,
+                     const boost::system::error_code& error, size_t bytes)
+  {
+    minfo->writing_ = false;
+    if (error || block->header_.eof_)
+    {
+      minfo->failed_ = true;
+      minfo->ready_.clear();
+      on_send(minfo, error, bytes);
+      if (!error)
+        std::cout << "file size: " << minfo->header_.length_ << std::endl;
+      return;
+    }
+    adapt_block_size(minfo, block->header_.size_);
+    minfo->write_seq_++;
+    // 送信済みのバッファを使い回して次のブロックへ
+    fill_pipeline(minfo, block);
+    write_block(minfo);
+  }
+  // 1ブロックの送信に掛かった時間が目標より十分短ければ大きく、
+  // 長ければ小さくする(sentはそのブロックの大きさ)
+  void adapt_block_size(SendFileInfoPtr minfo, size_t sent)
+  {
+    if (!adaptive_)
+      return;
+    auto elapsed = SendFileInfo::Clock::now() - minfo->write_start_;
+    auto bsize   = minfo->block_size_;
+    if (elapsed < ADAPT_TARGET / 4 && sent == bsize)
+      bsize = std::min(bsize * 2, block_size_);
+    else if (elapsed > ADAPT_TARGET * 2)
+      bsize = std::max(bsize / 2, MIN_BLOCK_SIZE);
+    minfo->block_size_ = bsize;
+  }
+  // まとめて書き込んだメッセージの完了
+  void on_send_messages(const boost::system::error_code& error)
+  {
+    if (error)
+      std::cerr << "error[send message]: " << error.message() << std::endl;
+    for (size_t i = 0; i < write_count_; i++)
+    {
+      auto info = std::move(send_que_.front());
+      send_que_.pop_front();
+      info->callback_(!error);
+      free_message(std::static_pointer_cast<SendInfo>(std::move(info)));
+    }
+    write_count_ = 0;
+    send_loop();
+  }
+  void on_send(SendInfoPtr info, const boost::system::error_code& error,
+               size_t bytes)
+  {
+    if (error)
+      std::cerr << "error[send body]: " << error.message() << std::endl;
+    complete_send(info, !error);
+  }
+  // 先頭のファイル送信を終えて次へ進む(失敗した場合も取り除かないと
+  // sending_が立ったままになり、以降の送信が止まる)
+  void complete_send(SendInfoPtr info, bool success)
+  {
+    info->callback_(success);
+    send_que_.pop_front();
+    send_loop();
+  }
 };
 
 } // namespace Network
@@ -0,0 +1,335 @@
+//
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/uuid/detail/md5.hpp>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// rsync方式の差分転送
+//  1. 受信側が手元のファイルのブロックごとのシグネチャ(弱いローリングチェックサム+MD5)を作る
+//  2. 送信側は自分のファイルを1バイトずつずらしながら一致するブロックを探し、
+//     "ブロックをコピー"か"データそのもの"の命令列を返す
+//  3. 受信側は手元のファイルと命令列から新しいファイルを組み立てる
+namespace Delta
+{
+namespace fs = boost::filesystem;
+using Buffer = std::vector<char>;
+using Digest = std::array<char, 16>;
+
+// 命令
+enum Op : char
+{
+  OP_COPY    = 'C', // [ブロック番号(u64)][ブロック数(u32)]
+  OP_LITERAL = 'L', // [長さ(u32)][データ]
+  OP_END     = 'E', // [ファイル全体のMD5]
+};
+
+namespace detail
+{
+template <class T>
+void
+put(Buffer& out, T v)
+{
+  auto p = reinterpret_cast<const char*>(&v);
+  out.insert(out.end(), p, p + sizeof(T));
+}
+template <class T>
+bool
+get(const char*& p, const char* end, T& v)
+{
+  if (end - p < ptrdiff_t(sizeof(T)))
+    return false;
+  std::memcpy(&v, p, sizeof(T));
+  p += sizeof(T);
+  return true;
+}
+
+inline Digest
+md5(const char* data, size_t size)
+{
+  boost::uuids::detail::md5 hash;
+  hash.process_bytes(data, size);
+  boost::uuids::detail::md5::digest_type digest;
+  hash.get_digest(digest);
+  Digest ret;
+  std::memcpy(ret.data(), digest, ret.size());
+  return ret;
+}
+
+// ローリングチェックサム(rsyncと同じもの)
+struct Rolling
+{
+  uint32_t a_ = 0;
+  uint32_t b_ = 0;
+  size_t   len_;
+
+  Rolling(const unsigned char* p, size_t len) : len_(len)
+  {
+    for (size_t i = 0; i < len; i++)
+    {
+      a_ += p[i];
+      b_ += (len - i) * p[i];
+    }
+  }
+  void     roll(unsigned char out, unsigned char in)
+  {
+    a_ += in - out;
+    b_ += a_ - len_ * out;
+  }
+  uint32_t value() const { return (a_ & 0xffff) | (b_ << 16); }
+};
+
+// 空のファイルはマップできないので別扱い
+struct MappedFile
+{
+  boost::iostreams::mapped_file_source file_;
+  const char*                          data_ = nullptr;
+  size_t                               size_ = 0;
+
+  bool open(const fs::path& path)
+  {
+    boost::system::error_code err;
+    auto                      size = fs::file_size(path, err);
+    if (err)
+      return false;
+    if (size > 0)
+    {
+      file_.open(path.generic_string());
+      if (!file_.is_open())
+        return false;
+      data_ = file_.data();
+      size_ = file_.size();
+    }
+    return true;
+  }
+};
+} // namespace detail
+
+// ファイルサイズに応じたブロックサイズ(おおよそ平方根、2KB〜64KB)
+inline uint32_t
+blockSize(uintmax_t size)
+{
+  auto bs = uint32_t(std::sqrt(double(size)) + 1023) & ~1023u;
+  return std::min(std::max(bs, 2048u), 65536u);
+}
+
+// シグネチャ作成: [ブロックサイズ(u32)][ブロック数(u64)]{[弱(u32)][MD5]}*
+inline bool
+signature(const fs::path& path, Buffer& out)
+{
+  detail::MappedFile file;
+  if (!file.open(path))
+    return false;
+  uint32_t bs = blockSize(file.size_);
+  uint64_t nb = file.size_ / bs;
+  out.clear();
+  out.reserve(sizeof(bs) + sizeof(nb) + nb * (4 + sizeof(Digest)));
+  detail::put(out, bs);
+  detail::put(out, nb);
+  for (uint64_t i = 0; i < nb; i++)
+  {
+    auto p = file.data_ + i * bs;
+    detail::Rolling r{reinterpret_cast<const unsigned char*>(p), bs};
+    detail::put(out, r.value());
+    auto d = detail::md5(p, bs);
+    out.insert(out.end(), d.begin(), d.end());
+  }
+  return true;
+}
+
+// 差分作成: シグネチャと自分のファイル(path)から命令列をoutpathに書き出す
+inline bool
+generate(const fs::path& path, const Buffer& sig, const fs::path& outpath)
+{
+  uint32_t    bs;
+  uint64_t    nb;
+  const char* sp   = sig.data();
+  const char* send = sig.data() + sig.size();
+  if (!detail::get(sp, send, bs) || !detail::get(sp, send, nb) || bs == 0 ||
+      uint64_t(send - sp) != nb * (4 + sizeof(Digest)))
+    return false;
+
+  // 弱いチェックサム -> ブロック番号
+  std::unordered_multimap<uint32_t, uint64_t> table;
+  table.reserve(nb);
+  std::vector<Digest> digests(nb);
+  for (uint64_t i = 0; i < nb; i++)
+  {
+    uint32_t weak;
+    detail::get(sp, send, weak);
+    std::memcpy(digests[i].data(), sp, sizeof(Digest));
+    sp += sizeof(Digest);
+    table.emplace(weak, i);
+  }
+
+  detail::MappedFile file;
+  if (!file.open(path))
+    return false;
+  std::ofstream ofs(outpath.generic_string(), std::ios::binary);
+  Buffer        out;
+  auto          flush = [&]() {
+    ofs.write(out.data(), out.size());
+    out.clear();
+  };
+  auto data = reinterpret_cast<const unsigned char*>(file.data_);
+  auto size = file.size_;
+
+  uint64_t copy_start = 0;
+  uint32_t copy_count = 0;
+  auto     emit_copy  = [&]() {
+    if (copy_count > 0)
+    {
+      out.push_back(OP_COPY);
+      detail::put(out, copy_start);
+      detail::put(out, copy_count);
+    }
+    copy_count = 0;
+  };
+  auto emit_literal = [&](size_t from, size_t to) {
+    static constexpr size_t LITERAL_MAX = 1024 * 1024;
+    while (from < to)
+    {
+      uint32_t len = std::min(to - from, LITERAL_MAX);
+      out.push_back(OP_LITERAL);
+      detail::put(out, len);
+      out.insert(out.end(), file.data_ + from, file.data_ + from + len);
+      from += len;
+      flush();
+    }
+  };
+
+  size_t pos = 0, literal = 0;
+  if (nb > 0 && size >= bs)
+  {
+    detail::Rolling r{data, bs};
+    for (;;)
+    {
+      uint64_t match = nb;
+      auto     range = table.equal_range(r.value());
+      if (range.first != range.second)
+      {
+        auto d = detail::md5(file.data_ + pos, bs);
+        for (auto it = range.first; it != range.second; ++it)
+        {
+          if (digests[it->second] == d)
+          {
+            match = it->second;
+            break;
+          }
+        }
+      }
+      if (match < nb)
+      {
+        if (literal < pos)
+        {
+          emit_copy();
+          emit_literal(literal, pos);
+        }
+        if (copy_count > 0 && copy_start + copy_count == match)
+        {
+          copy_count++;
+        }
+        else
+        {
+          emit_copy();
+          copy_start = match;
+          copy_count = 1;
+        }
+        pos += bs;
+        literal = pos;
+        if (pos + bs > size)
+          break;
+        r = detail::Rolling{data + pos, bs};
+      }
+      else
+      {
+        if (pos + bs >= size)
+          break;
+        r.roll(data[pos], data[pos + bs]);
+        pos++;
+      }
+    }
+  }
+  emit_copy();
+  emit_literal(literal, size);
+  out.push_back(OP_END);
+  auto d = detail::md5(file.data_, size);
+  out.insert(out.end(), d.begin(), d.end());
+  flush();
+  return bool(ofs);
+}
+
+// 差分適用: 手元のファイル(oldpath)と命令列(deltapath)からnewpathを作る
+// 出来上がったファイルのMD5が一致しなければfalse
+inline bool
+apply(const fs::path& oldpath, const fs::path& deltapath,
+      const fs::path& newpath, uint32_t bs)
+{
+  detail::MappedFile oldfile, delta;
+  if (!oldfile.open(oldpath) || !delta.open(deltapath))
+    return false;
+  std::ofstream             ofs(newpath.generic_string(), std::ios::binary);
+  boost::uuids::detail::md5 hash;
+  auto                      write = [&](const char* p, size_t n) {
+    ofs.write(p, n);
+    hash.process_bytes(p, n);
+  };
+
+  const char* p   = delta.data_;
+  const char* end = delta.data_ + delta.size_;
+  while (p < end)
+  {
+    char op = *p++;
+    if (op == OP_COPY)
+    {
+      uint64_t start;
+      uint32_t count;
+      if (!detail::get(p, end, start) || !detail::get(p, end, count) ||
+          (start + count) * bs > oldfile.size_)
+        return false;
+      write(oldfile.data_ + start * bs, size_t(count) * bs);
+    }
+    else if (op == OP_LITERAL)
+    {
+      uint32_t len;
+      if (!detail::get(p, end, len) || end - p < ptrdiff_t(len))
+        return false;
+      write(p, len);
+      p += len;
+    }
+    else if (op == OP_END)
+    {
+      boost::uuids::detail::md5::digest_type digest;
+      hash.get_digest(digest);
+      ofs.close();
+      return end - p == sizeof(Digest) &&
+             std::memcmp(p, digest, sizeof(Digest)) == 0 && bool(ofs);
+    }
+    else
+    {
+      return false;
+    }
+  }
+  return false;
+}
+
+// シグネチャに記録されたブロックサイズ
+inline uint32_t
+signatureBlockSize(const Buffer& sig)
+{
+  uint32_t bs = 0;
+  if (sig.size() >= sizeof(bs))
+    std::memcpy(&bs, sig.data(), sizeof(bs));
+  return bs;
+}
+
+} // namespace Delta
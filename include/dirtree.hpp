@@ -0,0 +1,107 @@
+//
+#pragma once
+
+#include <filestat.hpp>
+#include <map>
+#include <md5.hpp>
+#include <set>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// ディレクトリごとの要約(ハッシュ木)
+// 各ディレクトリの要約は、直下のファイルの(名前, サイズ, 更新時刻)と
+// サブディレクトリの(名前, 要約)から作る
+// 要約が一致するディレクトリは以下のファイルもすべて一致するので、
+// 比べるのは要約の違うディレクトリだけで済む
+namespace DirTree
+{
+struct Node
+{
+  std::map<std::string, FileStat::Stat> files_; // 直下のファイル(名前順)
+  std::set<std::string>                 dirs_;  // サブディレクトリ名
+  std::string                           digest_;
+};
+
+class Tree
+{
+  std::unordered_map<std::string, Node> nodes_; // 相対パス(""が最上位)
+
+public:
+  /// ファイルを加える(relは相対パス)
+  void add(const std::string& rel, const FileStat::Stat& st)
+  {
+    auto pos = rel.rfind('/');
+    if (pos == std::string::npos)
+    {
+      nodes_[""].files_[rel] = st;
+      return;
+    }
+    nodes_[rel.substr(0, pos)].files_[rel.substr(pos + 1)] = st;
+    // 親ディレクトリを辿って登録する(登録済みならそこから上も登録済み)
+    for (auto dir = rel.substr(0, pos);;)
+    {
+      auto p      = dir.rfind('/');
+      auto parent = p == std::string::npos ? std::string{} : dir.substr(0, p);
+      auto name   = p == std::string::npos ? dir : dir.substr(p + 1);
+      if (!nodes_[parent].dirs_.insert(name).second || parent.empty())
+        break;
+      dir = parent;
+    }
+  }
+  /// すべて加えた後で要約を計算する
+  void finish()
+  {
+    nodes_[""];
+    calc("");
+  }
+
+  /// ディレクトリ(相対パス)の情報(無ければnullptr)
+  const Node* find(const std::string& dir) const
+  {
+    auto it = nodes_.find(dir);
+    return it == nodes_.end() ? nullptr : &it->second;
+  }
+  /// ディレクトリの要約(無ければ空)
+  std::string digest(const std::string& dir) const
+  {
+    auto node = find(dir);
+    return node ? node->digest_ : std::string{};
+  }
+
+  static std::string join(std::string_view dir, std::string_view name)
+  {
+    std::string ret(dir);
+    if (!ret.empty())
+      ret += '/';
+    ret += name;
+    return ret;
+  }
+
+private:
+  const std::string& calc(const std::string& dir)
+  {
+    auto&     node = nodes_[dir];
+    MD5::Hash hash;
+    auto      put = [&](const std::string& s) {
+      hash.process_bytes(s.c_str(), s.size() + 1);
+    };
+    for (auto& f : node.files_)
+    {
+      put("F");
+      put(f.first);
+      put(std::to_string(f.second.size_));
+      put(std::to_string(f.second.mtime_));
+    }
+    for (auto& d : node.dirs_)
+    {
+      put("D");
+      put(d);
+      put(calc(join(dir, d)));
+    }
+    node.digest_ = MD5::toString(hash);
+    return node.digest_;
+  }
+};
+
+} // namespace DirTree
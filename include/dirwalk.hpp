@@ -0,0 +1,141 @@
+//
+#pragma once
+
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include <filestat.hpp>
+#include <filter.hpp>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <thread>
+#include <threadpool.hpp>
+#include <vector>
+
+// ディレクトリの並列走査
+// サブディレクトリごと(大きいディレクトリはさらに一定数のエントリごと)を
+// タスクにして、statを複数のスレッドから同時に発行する
+// ネットワークストレージのようにエントリごとの待ち時間が大きい環境向け
+namespace Walk
+{
+namespace fs = boost::filesystem;
+
+struct Entry : FileStat::Stat
+{
+  std::string path_; // 走査したディレクトリからの相対パス
+};
+using EntryList = std::vector<Entry>;
+// ディレクトリを読む前に呼ばれる(ワーカースレッドから同時に呼ばれる)
+using DirFunc = std::function<void(const fs::path&)>;
+// 見つかったファイルをまとまりごとに渡す(同上、まとまりの中はパス順)
+using FilesFunc = std::function<void(const EntryList&)>;
+
+/// 走査に使うスレッド数(statの待ち時間を隠すためCPU数より多くする)
+inline size_t
+defaultThreads()
+{
+  return std::max(4u, std::thread::hardware_concurrency() * 2);
+}
+
+struct Options
+{
+  size_t                nb_thread_ = defaultThreads();
+  std::string           base_;             // root以下のこのディレクトリだけを走査する
+  const Filter::Filter* filter_ = nullptr; // 相対パスで判定する
+  DirFunc               on_dir_;
+  FilesFunc             on_files_; // 走査の完了を待たずに結果を使う場合
+};
+
+/// root以下のファイルを列挙する(結果はパス順、パスはrootからの相対)
+/// フィルタで除外されるディレクトリには入らない
+inline EntryList
+parallel(const fs::path& root, const Options& opt = {})
+{
+  // これより多いエントリを持つディレクトリはstatを分割して並列に行う
+  static constexpr size_t STAT_CHUNK = 128;
+
+  using Names = std::shared_ptr<std::vector<std::string>>;
+  Concurrent::StealingPool pool{opt.nb_thread_};
+  std::vector<EntryList>   results(pool.size());
+
+  std::function<void(std::string)>                        list_dir;
+  std::function<void(std::string, Names, size_t, size_t)> stat_entries;
+
+  auto full_path = [&](const std::string& rel) {
+    return rel.empty() ? root : root / rel;
+  };
+  auto join = [](const std::string& dir, const std::string& name) {
+    return dir.empty() ? name : dir + "/" + name;
+  };
+
+  list_dir = [&](std::string rel) {
+    auto dir = full_path(rel);
+    if (opt.on_dir_)
+      opt.on_dir_(dir);
+    boost::system::error_code err;
+    auto names = std::make_shared<std::vector<std::string>>();
+    for (fs::directory_iterator it(dir, err), end; !err && it != end;
+         it.increment(err))
+    {
+      names->push_back(it->path().filename().string());
+    }
+    // 先頭以外のまとまりは他のワーカーに盗まれるようにキューに積む
+    for (size_t ofs = STAT_CHUNK; ofs < names->size(); ofs += STAT_CHUNK)
+    {
+      pool.spawn([&, rel, names, ofs]() {
+        stat_entries(rel, names, ofs, ofs + STAT_CHUNK);
+      });
+    }
+    stat_entries(rel, names, 0, STAT_CHUNK);
+  };
+  stat_entries = [&](std::string rel, Names names, size_t first, size_t last) {
+    EntryList found;
+    last = std::min(last, names->size());
+    for (auto i = first; i < last; i++)
+    {
+      Entry ent;
+      ent.path_ = join(rel, (*names)[i]);
+      switch (FileStat::get(full_path(ent.path_), ent))
+      {
+      case FileStat::Kind::File:
+        if (!opt.filter_ || opt.filter_->match(ent.path_))
+          found.push_back(std::move(ent));
+        break;
+      case FileStat::Kind::Directory:
+        if (!opt.filter_ || !opt.filter_->prune(ent.path_))
+          pool.spawn([&, sub = ent.path_]() { list_dir(sub); });
+        break;
+      case FileStat::Kind::Other:
+        break;
+      }
+    }
+    if (found.empty())
+      return;
+    if (opt.on_files_)
+    {
+      std::sort(found.begin(), found.end(), [](auto& a, auto& b) {
+        return a.path_ < b.path_;
+      });
+      opt.on_files_(found);
+    }
+    auto& out = results[pool.index()];
+    std::move(found.begin(), found.end(), std::back_inserter(out));
+  };
+  pool.run([&]() { list_dir(opt.base_); });
+
+  // ワーカーごとの結果をまとめて、実行順によらない順序にする
+  EntryList entries;
+  size_t    total = 0;
+  for (auto& r : results)
+    total += r.size();
+  entries.reserve(total);
+  for (auto& r : results)
+    std::move(r.begin(), r.end(), std::back_inserter(entries));
+  std::sort(entries.begin(), entries.end(), [](auto& a, auto& b) {
+    return a.path_ < b.path_;
+  });
+  return entries;
+}
+
+} // namespace Walk
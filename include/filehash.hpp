@@ -0,0 +1,266 @@
+//
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <md5.hpp>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// ファイル内容のハッシュ(方式を選べる)
+// 結果は"方式:16進"の形で、方式の違うもの同士を取り違えない
+//  xxh64 : 暗号用ではないが速い(既定)
+//  md5   : 従来の方式
+namespace FileHash
+{
+enum class Algo
+{
+  XXH64,
+  MD5,
+};
+
+inline std::string
+toString(Algo algo)
+{
+  return algo == Algo::MD5 ? "md5" : "xxh64";
+}
+inline Algo
+parse(const std::string& name)
+{
+  if (name == "xxh64")
+    return Algo::XXH64;
+  if (name == "md5")
+    return Algo::MD5;
+  throw std::invalid_argument("unknown hash: " + name);
+}
+
+/// 記録されていた値の方式(方式の無い32桁の16進は以前のMD5とみなす)
+inline std::optional<Algo>
+algoOf(const std::string& value)
+{
+  auto pos = value.find(':');
+  if (pos == std::string::npos)
+  {
+    bool hex = value.size() == 32 &&
+               value.find_first_not_of("0123456789abcdef") == std::string::npos;
+    return hex ? std::optional<Algo>{Algo::MD5} : std::nullopt;
+  }
+  try
+  {
+    return parse(value.substr(0, pos));
+  }
+  catch (std::exception&)
+  {
+    return std::nullopt;
+  }
+}
+/// 以前の形式の値を"方式:16進"に揃える
+inline std::string
+normalize(const std::string& value)
+{
+  return value.find(':') == std::string::npos ? "md5:" + value : value;
+}
+
+namespace detail
+{
+// XXH64(4本の独立した計算を並べて、1回に32バイトずつ処理する)
+class XXH64
+{
+  static constexpr uint64_t P1 = 0x9E3779B185EBCA87ULL;
+  static constexpr uint64_t P2 = 0xC2B2AE3D27D4EB4FULL;
+  static constexpr uint64_t P3 = 0x165667B19E3779F9ULL;
+  static constexpr uint64_t P4 = 0x85EBCA77C2B2AE63ULL;
+  static constexpr uint64_t P5 = 0x27D4EB2F165667C5ULL;
+
+  uint64_t      v_[4]    = {P1 + P2, P2, 0, 0 - P1};
+  uint64_t      total_   = 0;
+  unsigned char mem_[32] = {};
+  size_t        memsize_ = 0;
+
+  static constexpr uint64_t rotl(uint64_t x, int r)
+  {
+    return (x << r) | (x >> (64 - r));
+  }
+  // CPUのバイト順によらずリトルエンディアンとして読む
+  // (リトルエンディアンのCPUでは1回の読み込みにまとめられる)
+  static constexpr uint32_t read32(const unsigned char* p)
+  {
+    return uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 |
+           uint32_t(p[3]) << 24;
+  }
+  static constexpr uint64_t read64(const unsigned char* p)
+  {
+    return uint64_t(read32(p)) | uint64_t(read32(p + 4)) << 32;
+  }
+  static constexpr uint64_t round(uint64_t acc, uint64_t input)
+  {
+    acc += input * P2;
+    acc = rotl(acc, 31);
+    return acc * P1;
+  }
+  static constexpr uint64_t merge(uint64_t acc, uint64_t val)
+  {
+    acc ^= round(0, val);
+    return acc * P1 + P4;
+  }
+  constexpr void stripe(const unsigned char* p)
+  {
+    v_[0] = round(v_[0], read64(p));
+    v_[1] = round(v_[1], read64(p + 8));
+    v_[2] = round(v_[2], read64(p + 16));
+    v_[3] = round(v_[3], read64(p + 24));
+  }
+
+public:
+  void update(const char* data, size_t size)
+  {
+    update(reinterpret_cast<const unsigned char*>(data), size);
+  }
+  constexpr void update(const unsigned char* p, size_t size)
+  {
+    auto end = p + size;
+    total_ += size;
+    if (memsize_ > 0)
+    {
+      auto n = std::min<size_t>(32 - memsize_, size);
+      for (size_t i = 0; i < n; i++)
+        mem_[memsize_ + i] = p[i];
+      memsize_ += n;
+      p += n;
+      if (memsize_ < 32)
+        return;
+      stripe(mem_);
+      memsize_ = 0;
+    }
+    for (; end - p >= 32; p += 32)
+      stripe(p);
+    memsize_ = end - p;
+    for (size_t i = 0; i < memsize_; i++)
+      mem_[i] = p[i];
+  }
+  constexpr uint64_t digest() const
+  {
+    uint64_t h = P5;
+    if (total_ >= 32)
+    {
+      h = rotl(v_[0], 1) + rotl(v_[1], 7) + rotl(v_[2], 12) + rotl(v_[3], 18);
+      for (auto v : v_)
+        h = merge(h, v);
+    }
+    h += total_;
+    auto p   = mem_;
+    auto end = mem_ + memsize_;
+    for (; end - p >= 8; p += 8)
+      h = rotl(h ^ round(0, read64(p)), 27) * P1 + P4;
+    if (end - p >= 4)
+    {
+      h = rotl(h ^ (read32(p) * P1), 23) * P2 + P3;
+      p += 4;
+    }
+    for (; p < end; p++)
+      h = rotl(h ^ (*p * P5), 11) * P1;
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+  }
+};
+
+// 文字列(終端を除く)のXXH64
+template <size_t N>
+constexpr uint64_t
+xxh64Of(const char (&str)[N])
+{
+  unsigned char data[N] = {};
+  for (size_t i = 0; i + 1 < N; i++)
+    data[i] = static_cast<unsigned char>(str[i]);
+  XXH64 h;
+  h.update(data, N - 1);
+  return h.digest();
+}
+// 既知の値(32バイト未満と以上の両方)と照合する
+static_assert(xxh64Of("") == 0xEF46DB3751D8E999ULL, "XXH64");
+static_assert(xxh64Of("a") == 0xD24EC4F1A98C6E5BULL, "XXH64");
+static_assert(xxh64Of("abc") == 0x44BC2CF5AD770999ULL, "XXH64");
+static_assert(xxh64Of("Nobody inspects the spammish repetition") ==
+                  0xFBCEA83C8A378BF1ULL,
+              "XXH64");
+} // namespace detail
+
+// 1つの方式の計算
+class Hasher
+{
+  Algo          algo_;
+  detail::XXH64 xxh_;
+  MD5::Hash     md5_;
+
+public:
+  explicit Hasher(Algo algo) : algo_(algo) {}
+
+  void update(const char* data, size_t size)
+  {
+    if (algo_ == Algo::MD5)
+      md5_.process_bytes(data, size);
+    else
+      xxh_.update(data, size);
+  }
+  /// "方式:16進"
+  std::string finish()
+  {
+    if (algo_ == Algo::MD5)
+      return "md5:" + MD5::toString(md5_);
+    char hex[32];
+    std::snprintf(hex,
+                  sizeof(hex),
+                  "xxh64:%016llx",
+                  static_cast<unsigned long long>(xxh_.digest()));
+    return hex;
+  }
+};
+
+/// ファイルを1回読んで、指定した方式それぞれのハッシュを計算する
+/// (開けないか途中で読めなくなれば空のリスト)
+inline std::vector<std::string>
+calc(const std::string& path, const std::vector<Algo>& algos)
+{
+  // 大きく読んで読み込み回数を減らす
+  static constexpr size_t READ_SIZE = 1024 * 1024;
+
+  std::ifstream infile(path, std::ios::binary);
+  if (!infile)
+    return {};
+  std::vector<Hasher> hashers(algos.begin(), algos.end());
+  std::unique_ptr<char[]> buff(new char[READ_SIZE]);
+  for (;;)
+  {
+    infile.read(buff.get(), READ_SIZE);
+    auto nb = infile.gcount();
+    if (nb <= 0)
+      break;
+    for (auto& h : hashers)
+      h.update(buff.get(), nb);
+  }
+  // 途中で読めなくなった場合は、読めた所までの値を返さない
+  if (infile.bad())
+    return {};
+  std::vector<std::string> ret;
+  for (auto& h : hashers)
+    ret.push_back(h.finish());
+  return ret;
+}
+inline std::string
+calc(const std::string& path, Algo algo)
+{
+  auto ret = calc(path, std::vector<Algo>{algo});
+  return ret.empty() ? std::string{} : ret[0];
+}
+
+} // namespace FileHash
@@ -0,0 +1,79 @@
+//
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <cstdint>
+#include <ctime>
+#if !defined(_WIN32)
+#include <sys/stat.h>
+#endif
+
+// ファイルの属性(stat1回分)
+// 内容が変わっていないかの判定に使うので、更新時刻はナノ秒まで持つ
+namespace FileStat
+{
+namespace fs = boost::filesystem;
+
+struct Stat
+{
+  uint64_t    dev_      = 0;
+  uint64_t    ino_      = 0;
+  uintmax_t   size_     = 0;
+  std::time_t mtime_    = 0; // 秒(転送・比較用)
+  int64_t     mtime_ns_ = 0; // ナノ秒(変更検出用)
+
+  bool sameContent(const Stat& o) const
+  {
+    return dev_ == o.dev_ && ino_ == o.ino_ && size_ == o.size_ &&
+           mtime_ns_ == o.mtime_ns_;
+  }
+};
+
+enum class Kind
+{
+  File,
+  Directory,
+  Other,
+};
+
+// ディレクトリへのシンボリックリンクはOther(辿らない)
+inline Kind
+get(const fs::path& path, Stat& out)
+{
+#if !defined(_WIN32)
+  struct stat st;
+  if (::lstat(path.c_str(), &st) != 0)
+    return Kind::Other;
+  bool link = S_ISLNK(st.st_mode);
+  if (link && ::stat(path.c_str(), &st) != 0)
+    return Kind::Other;
+  if (S_ISDIR(st.st_mode))
+    return link ? Kind::Other : Kind::Directory;
+  out.dev_   = st.st_dev;
+  out.ino_   = st.st_ino;
+  out.size_  = st.st_size;
+  out.mtime_ = st.st_mtime;
+#if defined(__APPLE__)
+  out.mtime_ns_ = int64_t(st.st_mtimespec.tv_sec) * 1000000000 +
+                  st.st_mtimespec.tv_nsec;
+#else
+  out.mtime_ns_ = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+  return Kind::File;
+#else
+  boost::system::error_code err;
+  auto                      lst = fs::symlink_status(path, err);
+  if (err)
+    return Kind::Other;
+  if (fs::is_directory(lst))
+    return Kind::Directory;
+  if (fs::is_directory(path, err))
+    return Kind::Other;
+  out.size_     = fs::file_size(path, err);
+  out.mtime_    = fs::last_write_time(path, err);
+  out.mtime_ns_ = int64_t(out.mtime_) * 1000000000;
+  return err ? Kind::Other : Kind::File;
+#endif
+}
+
+} // namespace FileStat
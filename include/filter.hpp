@@ -0,0 +1,283 @@
+//
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <boost/xpressive/xpressive.hpp>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// 対象ファイルの選別(除外・対象ルール)
+// ルールは一度だけ組み立て、走査中はディレクトリ単位で丸ごと除外する
+//  "glob:<pattern>" : '/'を含まなければ各階層の名前、含めば相対パス全体と照合
+//                     ('*'と'?'は'/'に掛からない、"**"は掛かる)
+//  "path:<prefix>"  : 相対パスがprefixそのものか、prefix/以下
+//  "re:<regex>"     : フルパスを正規表現で検索
+//  それ以外         : 従来の-wと同じくフルパスを正規表現で検索
+//                     (正規表現の記号を含まなければ文字列検索で済ませる)
+namespace Filter
+{
+namespace fs = boost::filesystem;
+
+namespace detail
+{
+// globの照合(**は'/'をまたぐ)
+inline bool
+glob(const char* p, const char* s)
+{
+  for (; *p; p++, s++)
+  {
+    switch (*p)
+    {
+    case '*':
+      if (p[1] == '*')
+      {
+        // "**/"は0階層にも一致する
+        auto rest = p + 2;
+        if (*rest == '/' && glob(rest + 1, s))
+          return true;
+        for (;; s++)
+        {
+          if (glob(rest, s))
+            return true;
+          if (!*s)
+            return false;
+        }
+      }
+      for (;; s++)
+      {
+        if (glob(p + 1, s))
+          return true;
+        if (!*s || *s == '/')
+          return false;
+      }
+    case '?':
+      if (!*s || *s == '/')
+        return false;
+      break;
+    case '[':
+    {
+      if (!*s || *s == '/')
+        return false;
+      auto q   = p + 1;
+      bool neg = *q == '!' || *q == '^';
+      if (neg)
+        q++;
+      bool hit = false;
+      for (bool first = true; *q && (first || *q != ']'); q++, first = false)
+      {
+        if (q[1] == '-' && q[2] && q[2] != ']')
+        {
+          hit |= *q <= *s && *s <= q[2];
+          q += 2;
+        }
+        else
+        {
+          hit |= *q == *s;
+        }
+      }
+      if (!*q || hit == neg)
+        return false;
+      p = q;
+      break;
+    }
+    case '\\':
+      if (p[1])
+        p++;
+      // fall through
+    default:
+      if (*p != *s)
+        return false;
+      break;
+    }
+  }
+  return !*s;
+}
+
+inline bool
+hasGlobChar(const std::string& s)
+{
+  return s.find_first_of("*?[\\") != std::string::npos;
+}
+inline bool
+hasRegexChar(const std::string& s)
+{
+  return s.find_first_of(".^$|()[]{}*+?\\") != std::string::npos;
+}
+} // namespace detail
+
+// ルール1つ分
+class Rule
+{
+  enum class Type
+  {
+    Literal, // フルパス中の文字列
+    Regex,   // フルパスの正規表現検索
+    Name,    // 各階層の名前(glob)
+    Path,    // 相対パス全体(glob)
+    Prefix,  // 相対パスの先頭
+  };
+  using sregex = boost::xpressive::sregex;
+
+  Type                    type_;
+  std::string             text_;
+  bool                    wild_ = false; // globの記号を含む
+  std::shared_ptr<sregex> rex_;
+
+public:
+  Rule(const std::string& rule)
+  {
+    auto starts = [&](const char* p) { return rule.rfind(p, 0) == 0; };
+    if (starts("glob:"))
+    {
+      text_ = rule.substr(5);
+      type_ = text_.find('/') == std::string::npos ? Type::Name : Type::Path;
+      wild_ = detail::hasGlobChar(text_);
+    }
+    else if (starts("path:"))
+    {
+      text_ = rule.substr(5);
+      while (!text_.empty() && text_.back() == '/')
+        text_.pop_back();
+      type_ = Type::Prefix;
+    }
+    else
+    {
+      text_ = starts("re:") ? rule.substr(3) : rule;
+      type_ = detail::hasRegexChar(text_) ? Type::Regex : Type::Literal;
+      if (type_ == Type::Regex)
+        rex_ = std::make_shared<sregex>(sregex::compile(text_));
+    }
+    if (text_.empty())
+      throw std::invalid_argument("empty filter rule: " + rule);
+  }
+
+  /// ファイルが一致するか(relは相対パス、fullはフルパス)
+  bool match(const std::string& rel, const std::string& full) const
+  {
+    switch (type_)
+    {
+    case Type::Literal:
+      return full.find(text_) != std::string::npos;
+    case Type::Regex:
+      return boost::xpressive::regex_search(full, *rex_);
+    case Type::Name:
+    {
+      // どこかの階層の名前が一致すればよい
+      size_t pos = 0;
+      for (;;)
+      {
+        auto next = rel.find('/', pos);
+        auto name = rel.substr(pos, next - pos);
+        if (wild_ ? detail::glob(text_.c_str(), name.c_str()) : name == text_)
+          return true;
+        if (next == std::string::npos)
+          return false;
+        pos = next + 1;
+      }
+    }
+    case Type::Path:
+      return wild_ ? detail::glob(text_.c_str(), rel.c_str()) : rel == text_;
+    case Type::Prefix:
+      return rel.compare(0, text_.size(), text_) == 0 &&
+             (rel.size() == text_.size() || rel[text_.size()] == '/');
+    }
+    return false;
+  }
+  /// このディレクトリ以下がすべて一致すると言えるか
+  bool matchDir(const std::string& rel, const std::string& full) const
+  {
+    switch (type_)
+    {
+    case Type::Literal:
+      // ディレクトリのパスに含まれていれば、その下のパスにも必ず含まれる
+      return (full + "/").find(text_) != std::string::npos;
+    case Type::Regex:
+      // 一般の正規表現では判断できない
+      return false;
+    case Type::Name:
+    case Type::Path:
+    case Type::Prefix:
+      return match(rel, full);
+    }
+    return false;
+  }
+};
+
+// 除外ルールと対象ルールの組
+// 除外ルールのどれかに一致するものは除外、
+// 対象ルールがあればどれかに一致するものだけを対象にする
+class Filter
+{
+  std::string       root_; // フルパスを作るための基準ディレクトリ
+  std::vector<Rule> excludes_;
+  std::vector<Rule> includes_;
+  bool              need_full_ = false;
+  std::string       key_;
+
+public:
+  Filter() = default;
+  Filter(const fs::path& root) : root_(root.generic_string())
+  {
+    if (!root_.empty() && root_.back() == '/')
+      root_.pop_back();
+  }
+
+  /// ルールの追加(正規表現が不正なら例外)
+  void exclude(const std::string& rule) { add(excludes_, "-", rule); }
+  void include(const std::string& rule) { add(includes_, "+", rule); }
+
+  bool empty() const { return excludes_.empty() && includes_.empty(); }
+  /// ルールを表す文字列(同じルールの組なら同じ値)
+  const std::string& key() const { return key_; }
+
+  /// ファイルを対象にするか
+  bool match(const std::string& rel) const
+  {
+    if (empty())
+      return true;
+    auto full = need_full_ ? fullPath(rel) : std::string{};
+    for (auto& r : excludes_)
+    {
+      if (r.match(rel, full))
+        return false;
+    }
+    if (includes_.empty())
+      return true;
+    for (auto& r : includes_)
+    {
+      if (r.match(rel, full))
+        return true;
+    }
+    return false;
+  }
+  /// ディレクトリを丸ごと走査しなくてよいか
+  bool prune(const std::string& rel) const
+  {
+    if (excludes_.empty() || rel.empty())
+      return false;
+    auto full = need_full_ ? fullPath(rel) : std::string{};
+    for (auto& r : excludes_)
+    {
+      if (r.matchDir(rel, full))
+        return true;
+    }
+    return false;
+  }
+
+private:
+  void add(std::vector<Rule>& rules, const char* kind, const std::string& rule)
+  {
+    rules.emplace_back(rule);
+    auto starts = [&](const char* p) { return rule.rfind(p, 0) == 0; };
+    need_full_ |= !starts("glob:") && !starts("path:");
+    key_ += kind + rule + '\n';
+  }
+  std::string fullPath(const std::string& rel) const
+  {
+    return rel.empty() ? root_ : root_ + "/" + rel;
+  }
+};
+
+} // namespace Filter
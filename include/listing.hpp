@@ -0,0 +1,126 @@
+//
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// ファイル一覧のバイナリ形式
+// 一覧は複数のまとまり(チャンク)に分けて送り、受信側は届いた順に処理できる
+// チャンク内のパスは直前のパスとの共通部分を省き、数値は可変長で詰める
+//  {[共通部分の長さ][残りの長さ][残り][更新時刻][サイズ][ハッシュの長さ][ハッシュ]}*
+//  (数値はすべてvarint: 下位から7bitずつ、続きがあれば最上位bitを立てる)
+namespace Listing
+{
+using Buffer = std::vector<char>;
+
+// 1チャンクの目安の大きさ
+static constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+namespace detail
+{
+inline void
+putVarint(Buffer& out, uint64_t v)
+{
+  while (v >= 0x80)
+  {
+    out.push_back(char(v | 0x80));
+    v >>= 7;
+  }
+  out.push_back(char(v));
+}
+inline bool
+getVarint(const char*& p, const char* end, uint64_t& v)
+{
+  v = 0;
+  for (int shift = 0; p < end && shift < 64; shift += 7)
+  {
+    auto c = uint8_t(*p++);
+    v |= uint64_t(c & 0x7f) << shift;
+    if ((c & 0x80) == 0)
+      return true;
+  }
+  return false;
+}
+} // namespace detail
+
+// 1ファイル分
+struct Record
+{
+  std::string path_;
+  uint64_t    mtime_;
+  uint64_t    size_;
+  std::string hash_; // 無ければ空
+};
+
+// チャンクの組み立て
+class Encoder
+{
+  Buffer      out_;
+  std::string prev_;
+  size_t      count_ = 0;
+
+public:
+  void add(const std::string& path, uint64_t mtime, uint64_t size,
+           const std::string& hash)
+  {
+    size_t common = 0;
+    auto   limit  = std::min(path.size(), prev_.size());
+    while (common < limit && path[common] == prev_[common])
+      common++;
+    detail::putVarint(out_, common);
+    detail::putVarint(out_, path.size() - common);
+    out_.insert(out_.end(), path.begin() + common, path.end());
+    detail::putVarint(out_, mtime);
+    detail::putVarint(out_, size);
+    detail::putVarint(out_, hash.size());
+    out_.insert(out_.end(), hash.begin(), hash.end());
+    prev_ = path;
+    count_++;
+  }
+
+  bool   full() const { return out_.size() >= CHUNK_SIZE; }
+  bool   empty() const { return count_ == 0; }
+  size_t count() const { return count_; }
+
+  /// 組み立てたチャンクを取り出して次のチャンクを始める
+  Buffer take()
+  {
+    Buffer ret;
+    ret.swap(out_);
+    prev_.clear();
+    count_ = 0;
+    return ret;
+  }
+};
+
+/// チャンクを先頭から順に取り出す(壊れていた場合はfalse)
+template <class Func>
+bool
+decode(const char* p, size_t size, Func func)
+{
+  const char* end = p + size;
+  Record      rec;
+  while (p < end)
+  {
+    uint64_t common, len, hlen;
+    if (!detail::getVarint(p, end, common) ||
+        !detail::getVarint(p, end, len) || common > rec.path_.size() ||
+        uint64_t(end - p) < len)
+      return false;
+    rec.path_.resize(common);
+    rec.path_.append(p, len);
+    p += len;
+    if (!detail::getVarint(p, end, rec.mtime_) ||
+        !detail::getVarint(p, end, rec.size_) ||
+        !detail::getVarint(p, end, hlen) || uint64_t(end - p) < hlen)
+      return false;
+    rec.hash_.assign(p, hlen);
+    p += hlen;
+    func(rec);
+  }
+  return true;
+}
+
+} // namespace Listing
@@ -1,8 +1,10 @@
 //
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <boost/uuid/detail/md5.hpp>
+#include <cstdint>
 #include <cstdio>
 #include <fstream>
 #include <string>
@@ -11,19 +13,10 @@ namespace MD5
 {
 using Hash = boost::uuids::detail::md5;
 
-// 1ファイル分のMD5を計算
-std::string
-calc(std::string path)
+// 計算を終えて16進文字列にする
+inline std::string
+toString(Hash& hash)
 {
-  std::ifstream infile(path, std::ios::binary);
-  Hash          hash;
-  while (infile.eof() == false)
-  {
-    std::array<char, 8192> buff;
-    infile.read(buff.data(), buff.size());
-    auto nb = infile.gcount();
-    hash.process_bytes(buff.data(), nb);
-  }
   Hash::digest_type digest;
   hash.get_digest(digest);
   char md5string[64];
@@ -36,4 +29,23 @@ calc(std::string path)
                 digest[3]);
   return md5string;
 }
+
+// 1ファイル分のMD5を計算(sizeを指定すると先頭からその長さ分)
+std::string
+calc(std::string path, uintmax_t size = UINTMAX_MAX)
+{
+  std::ifstream infile(path, std::ios::binary);
+  Hash          hash;
+  while (infile.eof() == false && size > 0)
+  {
+    std::array<char, 8192> buff;
+    infile.read(buff.data(), std::min<uintmax_t>(buff.size(), size));
+    auto nb = infile.gcount();
+    hash.process_bytes(buff.data(), nb);
+    size -= nb;
+    if (nb == 0)
+      break;
+  }
+  return toString(hash);
+}
 } // namespace MD5
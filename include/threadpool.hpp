@@ -0,0 +1,215 @@
+//
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+namespace Concurrent
+{
+using Task = std::function<void()>;
+
+// 固定数のワーカースレッドでタスクを処理する
+class ThreadPool
+{
+  std::vector<std::thread> threads_;
+  std::queue<Task>         tasks_;
+  std::mutex               lock_;
+  std::condition_variable  cond_;
+  bool                     finish_;
+
+public:
+  ThreadPool(size_t nb_thread) : finish_(false)
+  {
+    nb_thread = std::max<size_t>(1, nb_thread);
+    for (size_t i = 0; i < nb_thread; i++)
+    {
+      threads_.emplace_back([this]() { work(); });
+    }
+  }
+  ~ThreadPool()
+  {
+    {
+      std::lock_guard<std::mutex> l(lock_);
+      finish_ = true;
+    }
+    cond_.notify_all();
+    for (auto& th : threads_)
+    {
+      th.join();
+    }
+  }
+
+  size_t size() const { return threads_.size(); }
+
+  /// タスク登録
+  void post(Task task)
+  {
+    {
+      std::lock_guard<std::mutex> l(lock_);
+      tasks_.push(std::move(task));
+    }
+    cond_.notify_one();
+  }
+
+  /// プロセス共通のプール(CPU数分)
+  static ThreadPool& shared()
+  {
+    static ThreadPool pool{std::thread::hardware_concurrency()};
+    return pool;
+  }
+
+private:
+  void work()
+  {
+    for (;;)
+    {
+      Task task;
+      {
+        std::unique_lock<std::mutex> l(lock_);
+        cond_.wait(l, [this]() { return finish_ || !tasks_.empty(); });
+        if (tasks_.empty())
+          break;
+        task = std::move(tasks_.front());
+        tasks_.pop();
+      }
+      task();
+    }
+  }
+};
+
+// タスクから次々にタスクが生まれる処理(ディレクトリ走査など)向け
+// ワーカーごとに両端キューを持ち、自分のキューは後ろから取り出し、
+// 空になったら他のワーカーのキューの前から盗む
+class StealingPool
+{
+  struct Worker
+  {
+    std::mutex       lock_;
+    std::deque<Task> tasks_;
+  };
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::atomic<size_t>                  pending_; // 未完了のタスク数
+  std::atomic<size_t>                  queued_;  // キューに入っているタスク数
+  std::mutex                           idle_lock_;
+  std::condition_variable              idle_cond_;
+
+  struct Current
+  {
+    StealingPool* pool_  = nullptr;
+    size_t        index_ = 0;
+  };
+  static Current& current()
+  {
+    static thread_local Current cur;
+    return cur;
+  }
+
+public:
+  StealingPool(size_t nb_thread) : pending_(0), queued_(0)
+  {
+    nb_thread = std::max<size_t>(1, nb_thread);
+    for (size_t i = 0; i < nb_thread; i++)
+    {
+      workers_.emplace_back(std::make_unique<Worker>());
+    }
+  }
+
+  size_t size() const { return workers_.size(); }
+
+  /// 実行中のワーカー番号(0〜size()-1)
+  size_t index() const
+  {
+    auto& cur = current();
+    return cur.pool_ == this ? cur.index_ : 0;
+  }
+
+  /// タスク登録(タスクの中から呼ぶと自分のキューに積む)
+  void spawn(Task task)
+  {
+    pending_++;
+    auto& w = *workers_[index()];
+    {
+      std::lock_guard<std::mutex> l(w.lock_);
+      w.tasks_.push_back(std::move(task));
+    }
+    queued_++;
+    std::lock_guard<std::mutex> l(idle_lock_);
+    idle_cond_.notify_one();
+  }
+
+  /// taskとそこから登録されたタスクがすべて終わるまで実行する
+  /// (呼び出したスレッドもワーカーの1つになる)
+  void run(Task task)
+  {
+    spawn(std::move(task));
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < workers_.size(); i++)
+    {
+      threads.emplace_back([this, i]() { work(i); });
+    }
+    work(0);
+    for (auto& th : threads)
+    {
+      th.join();
+    }
+  }
+
+private:
+  bool take(size_t self, Task& task)
+  {
+    for (size_t n = 0; n < workers_.size(); n++)
+    {
+      auto&                       w = *workers_[(self + n) % workers_.size()];
+      std::lock_guard<std::mutex> l(w.lock_);
+      if (w.tasks_.empty())
+        continue;
+      if (n == 0)
+      {
+        task = std::move(w.tasks_.back());
+        w.tasks_.pop_back();
+      }
+      else
+      {
+        task = std::move(w.tasks_.front());
+        w.tasks_.pop_front();
+      }
+      queued_--;
+      return true;
+    }
+    return false;
+  }
+  void work(size_t self)
+  {
+    auto prev = current();
+    current() = {this, self};
+    for (;;)
+    {
+      Task task;
+      if (take(self, task))
+      {
+        task();
+        if (--pending_ == 0)
+        {
+          std::lock_guard<std::mutex> l(idle_lock_);
+          idle_cond_.notify_all();
+        }
+        continue;
+      }
+      std::unique_lock<std::mutex> l(idle_lock_);
+      idle_cond_.wait(l, [this]() { return queued_ > 0 || pending_ == 0; });
+      if (pending_ == 0)
+        break;
+    }
+    current() = prev;
+  }
+};
+
+} // namespace Concurrent
@@ -7,19 +7,29 @@
 #include <boost/filesystem.hpp>
 #include <boost/range/iterator_range.hpp>
 #include <boost/uuid/detail/md5.hpp>
+#include <bundle.hpp>
 #include <connection.hpp>
 #include <cstdio>
 #include <cxxopts.hpp>
+#include <delta.hpp>
+#include <dirtree.hpp>
+#include <dirwalk.hpp>
+#include <filestat.hpp>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <iterator>
+#include <listing.hpp>
+#include <map>
+#include <md5.hpp>
 #include <memory>
 #include <nlohmann/json.hpp>
 #include <string>
 #include <thread>
 #include <vector>
 
+#include "statedb.hpp"
+
 namespace
 {
 namespace asio = boost::asio;
@@ -38,13 +48,18 @@ struct FileInfo
   fs::path    real_path_;
   std::string old_hash_;
   std::string new_hash_;
+  time_t      mtime_; // サーバ側の更新時刻
+  uintmax_t   size_;
   bool        exists_;
 
   bool operator==(const FileInfo& o) { return file_name_ == o.file_name_; }
   bool operator==(const std::string fn) { return file_name_ == fn; }
 };
 
+// 転送中のファイル(転送中は変更しない)
 std::vector<FileInfo> fileList;
+// 次に転送するファイル(転送中に届いた変更もここに溜める)
+std::map<std::string, FileInfo> pendingList;
 
 //
 //
@@ -58,20 +73,79 @@ class Client : public Network::ConnectionBase
   fs::path         output_dir_;
   std::atomic_bool is_connect_;
   std::atomic_bool is_finished_;
+  int              max_request_; // 同時に要求するファイル数
+  uintmax_t        small_size_;  // これ以下のファイルはまとめて要求する
+  bool             use_delta_;   // 手元にあるファイルは差分だけ受け取る
+  bool             follow_;      // 転送後も接続したまま変更を受け取る
+  bool             watching_;
+  bool             req_hash_;    // 一覧にハッシュを付けてもらう
+  bool             use_hash_;    // サーバが受け付けた
+  bool             bin_list_;    // 一覧をバイナリ形式で分けて受け取る
+  bool             list_done_;   // 一覧を最後まで受け取った
+  bool             use_tree_;    // ハッシュ木で違うディレクトリだけ受け取る
+  bool             prefetch_;    // 要求する前のファイルをサーバに先読みさせる
+  size_t           verifying_;   // ハッシュを照合中のファイル数
+  bool             verify_;      // 記録のあるファイルも手元に残っているか調べる
+  size_t           checking_;    // 残っているか調べているまとまりの数
+  size_t           req_block_size_;
+  bool             req_adaptive_;
+  Codec::Setting   req_codec_;
+  int              request_count_;
+  size_t           next_index_;
+  size_t           prefetch_index_; // ここまでは先読みを依頼した
+  size_t           done_count_;
+
+  DirTree::Tree         local_tree_; // 接続前の手元の要約
+  Network::BufferList   tree_next_;  // 次に要求するディレクトリ
+  State::StateDB        state_;      // 受信済みファイルの記録
+  std::string           state_root_; // 記録のキーにする手元のフルパスの先頭
+  std::vector<FileInfo> unchecked_;  // 記録と一致した(残っているか未確認)
 
 public:
   Client(asio::io_service& io_service)
       : Super(io_service), resolver_(io_service), is_connect_(false),
-        is_finished_(false)
+        is_finished_(false), max_request_(1), small_size_(0),
+        use_delta_(false), follow_(false), watching_(false),
+        req_hash_(false), use_hash_(false), bin_list_(false),
+        list_done_(false), use_tree_(false), prefetch_(false),
+        verifying_(0), verify_(false), checking_(0),
+        req_block_size_(DEFAULT_BLOCK_SIZE), req_adaptive_(false),
+        request_count_(0), next_index_(0), prefetch_index_(0), done_count_(0)
   {
   }
 
-  void start(std::string sv, std::string dir)
+  void start(std::string sv, std::string dir, int nb_request,
+             uintmax_t small_size)
   {
     server_name_ = sv;
     output_dir_  = dir;
+    max_request_ = std::max(1, nb_request);
+    small_size_  = small_size;
+    // 記録のキーは手元のフルパス(出力先の異なる記録を1つにまとめられる)
+    state_root_ = fs::absolute(output_dir_).lexically_normal().generic_string();
+    if (state_root_.size() > 1 &&
+        state_root_.compare(state_root_.size() - 2, 2, "/.") == 0)
+      state_root_.pop_back();
+    if (state_root_.empty() || state_root_.back() != '/')
+      state_root_ += '/';
+    scan_local();
     connect();
   }
+  // 受信済みファイルの記録を使う(start()の前に開く)
+  bool openState(const std::string& path) { return state_.open(path); }
+  void setDelta(bool delta) { use_delta_ = delta; }
+  // 記録と一致したファイルも手元で消されていないか調べる
+  void setVerify(bool verify) { verify_ = verify; }
+  void setFollow(bool follow) { follow_ = follow; }
+  // 同じサイズのファイルは内容のハッシュで比べる(更新時刻だけ違うものは受け取らない)
+  void setHash(bool hash) { req_hash_ = hash; }
+  // 希望する転送ブロックサイズと圧縮形式(接続時にサーバと取り決める)
+  void setTransferBlock(size_t size, bool adaptive, Codec::Setting codec)
+  {
+    req_block_size_ = size;
+    req_adaptive_   = adaptive;
+    req_codec_      = codec;
+  }
 
   // ファイルリストリクエスト
   void requestFileList(const std::vector<std::string>& cmd)
@@ -130,41 +204,109 @@ private:
       std::cout << "connect failed : " << error.message() << std::endl;
       return;
     }
+    // 小さいメッセージを先行して送るのでNagleで待たせない
+    socket_.set_option(tcp::no_delay(true));
+    // 転送ブロックサイズ・圧縮形式と使いたい機能の取り決め
+    Network::BufferList hello{std::to_string(req_block_size_),
+                              req_adaptive_ ? "adaptive" : "fixed",
+                              Codec::toString(req_codec_),
+                              req_hash_ ? "hash" : "nohash",
+                              "binlist",
+                              "tree",
+                              "prefetch"};
+    Super::send("hello", hello, [&](bool) {});
     receive();
     is_connect_ = true;
   }
   //
   void receive()
   {
-    start_receive([&](auto cmd, auto buff) {
+    start_receive([&](auto cmd, auto& buff) {
       std::string command = cmd;
       if (command != "error" && buff.size() > 0)
       {
-        if (command == "filelist")
+        if (command == "hello")
         {
-          for (size_t i = 0; i < buff.size(); i += 2)
+          // 送信側(サーバ)が決めたブロックサイズと圧縮形式
+          auto bsize = setBlockSize(Network::toNumber(buff[0]), req_adaptive_);
+          if (buff.size() > 1)
+            setCodec(Codec::parse(std::string(buff[1])));
+          // 以降はサーバが受け付けた機能
+          for (size_t i = 2; i < buff.size(); i++)
           {
-            auto fname   = buff[i];
-            auto rpath   = (output_dir_ / fname).lexically_normal();
-            auto timestr = i + 1 < buff.size() ? buff[i + 1] : "";
-            auto wtime   = std::stoull(timestr);
-
-            time_t uptime = 0;
-            if (fs::exists(rpath))
-            {
-              // ファイルがあるなら更新時刻を取得
-              uptime = fs::last_write_time(rpath);
-            }
-
-            if (wtime > uptime)
-            {
-              // サーバの方が新しい=更新
-              FileInfo nf;
-              nf.file_name_ = fname;
-              nf.real_path_ = rpath;
-              fileList.push_back(nf);
-            }
+            use_hash_ |= buff[i] == "hash";
+            bin_list_ |= buff[i] == "binlist";
+            use_tree_ |= buff[i] == "tree";
+            prefetch_ |= buff[i] == "prefetch";
           }
+          if (verboseMode)
+            std::cout << "block size: " << bsize
+                      << " codec: " << Codec::toString(codec_)
+                      << (use_hash_ ? " hash" : "")
+                      << (bin_list_ ? " binlist" : "")
+                      << (use_tree_ ? " tree" : "")
+                      << (prefetch_ ? " prefetch" : "") << std::endl;
+        }
+        else if (bin_list_ && (command == "filelist" || command == "update"))
+        {
+          // バイナリ形式の一覧の1チャンク(届いた分から転送を始める)
+          bool force = command == "update";
+          bool ok    = Listing::decode(
+              buff[0].data(), buff[0].size(), [&](auto& rec) {
+                add_file(rec.path_, rec.mtime_, rec.size_, rec.hash_, force);
+              });
+          if (!ok)
+            std::cerr << "broken filelist" << std::endl;
+          check_local();
+          asio::post(strand_, [&]() { copy_loop(); });
+        }
+        else if (command == "treeroot")
+        {
+          // 最上位の要約が同じなら何も受け取らなくてよい
+          tree_next_.clear();
+          if (buff[0] != local_tree_.digest(""))
+            tree_next_.push_back("");
+          request_tree();
+        }
+        else if (command == "treedirs")
+        {
+          // 要約の違うサブディレクトリを次に要求する
+          for (size_t i = 1; i + 2 <= buff.size(); i += 2)
+          {
+            auto rel = DirTree::Tree::join(buff[0], buff[i]);
+            if (buff[i + 1] != local_tree_.digest(rel))
+              tree_next_.push_back(rel);
+          }
+        }
+        else if (command == "treeend")
+        {
+          request_tree();
+        }
+        else if (command == "filelistend")
+        {
+          // 一覧の終わり
+          list_done_ = true;
+          asio::post(strand_, [&]() { copy_loop(); });
+        }
+        else if (command == "filelist" || command == "update")
+        {
+          // (パス, 更新時刻, サイズ[, ハッシュ])の並び
+          // updateはサーバ側で変更されたファイルなので時刻によらず受け取る
+          // テキスト形式の一覧は1つのメッセージで全体が届く
+          bool   force  = command == "update";
+          size_t stride = use_hash_ ? 4 : 3;
+          if (command == "filelist")
+            list_done_ = true;
+          for (size_t i = 0; i + stride <= buff.size(); i += stride)
+          {
+            add_file(std::string(buff[i]),
+                     Network::toNumber(buff[i + 1]),
+                     Network::toNumber(buff[i + 2]),
+                     use_hash_ ? std::string(buff[i + 3]) : std::string{},
+                     force);
+          }
+          check_local();
+          asio::post(strand_, [&]() { copy_loop(); });
         }
       }
       //
@@ -176,41 +318,466 @@ private:
       }
       else
       {
-        asio::post([&]() { copy_loop(0); });
+        // ファイル転送もこの受信ループの中で処理される
+        receive();
       }
     });
   }
 
-  //
-  void copy_loop(int idx)
+  // 手元のファイルの要約を作る(サーバが対応していれば一覧の代わりに比べる)
+  // 受信済みファイルの記録があれば、走査せずに記録から作る
+  // (手元で消されたファイルも調べる場合は走査する)
+  void scan_local()
+  {
+    local_tree_ = {};
+    if (state_.isOpen() && !verify_)
+    {
+      state_.each(state_root_, [&](auto& key, auto& rec) {
+        FileStat::Stat st;
+        st.size_  = rec.size_;
+        st.mtime_ = rec.mtime_;
+        local_tree_.add(key.substr(state_root_.size()), st);
+      });
+    }
+    else
+    {
+      for (auto& e : Walk::parallel(output_dir_))
+        local_tree_.add(e.path_, e);
+    }
+    local_tree_.finish();
+  }
+  // 要約の違ったディレクトリを要求する(無ければ一覧はすべて受け取った)
+  void request_tree()
+  {
+    if (tree_next_.empty())
+    {
+      list_done_ = true;
+      asio::post(strand_, [&]() { copy_loop(); });
+      return;
+    }
+    if (verboseMode)
+      std::cout << "tree: " << tree_next_.size() << " dirs" << std::endl;
+    Super::send("treereq", tree_next_, [&](bool) {});
+    tree_next_.clear();
+  }
+
+  // 受信済みの記録
+  void record(const FileInfo& fi)
+  {
+    state_.put(state_root_ + fi.file_name_,
+               {fi.mtime_, fi.size_, fi.new_hash_});
+  }
+  // 転送待ちに加える(受信ハンドラ=strand_上)
+  void add_file(std::string fname, time_t wtime, uintmax_t fsize,
+                std::string hash, bool force)
+  {
+    FileInfo nf;
+    nf.file_name_ = fname;
+    nf.real_path_ = (output_dir_ / fname).lexically_normal();
+    nf.new_hash_  = hash;
+    nf.mtime_     = wtime;
+    nf.size_      = fsize;
+    nf.exists_    = true;
+
+    // 前回受け取った時とサーバ側が同じなら手元は調べない
+    // (updateは同じ秒の中での書き換えもあるので必ず調べる)
+    State::Record old;
+    if (!force && state_.get(state_root_ + fname, old) &&
+        old == State::Record{wtime, fsize, hash})
+    {
+      // 消されていないかはまとめてワーカーで調べる(check_local)
+      if (verify_)
+        unchecked_.push_back(std::move(nf));
+      return;
+    }
+    FileStat::Stat st;
+    nf.exists_ = FileStat::get(nf.real_path_, st) == FileStat::Kind::File;
+    if (!nf.exists_ || (hash.empty() && (force || wtime > st.mtime_)) ||
+        (!hash.empty() && st.size_ != fsize))
+    {
+      // サーバの方が新しい=更新
+      pendingList[fname] = nf;
+    }
+    else if (!hash.empty() && (force || wtime != st.mtime_))
+    {
+      // 同じサイズで更新時刻が違うものは内容を比べる
+      verify_file(nf);
+    }
+    else
+    {
+      // 受け取らなくてよかったことを記録しておく
+      record(nf);
+    }
+  }
+  // 記録と一致したファイルが手元に残っているかをワーカーで並列に調べ、
+  // 消されていたものを転送待ちに加える
+  void check_local()
+  {
+    static constexpr size_t CHECK_CHUNK = 256;
+
+    for (size_t ofs = 0; ofs < unchecked_.size(); ofs += CHECK_CHUNK)
+    {
+      auto first = unchecked_.begin() + ofs;
+      auto last  = first + std::min(CHECK_CHUNK, unchecked_.size() - ofs);
+      auto files = std::make_shared<std::vector<FileInfo>>(first, last);
+      checking_++;
+      Concurrent::ThreadPool::shared().post(
+          [this, self = shared_from_this(), files]() {
+            std::vector<FileInfo> missing;
+            for (auto& f : *files)
+            {
+              FileStat::Stat st;
+              if (FileStat::get(f.real_path_, st) != FileStat::Kind::File)
+              {
+                f.exists_ = false;
+                missing.push_back(f);
+              }
+            }
+            asio::post(strand_, [this, self, missing]() {
+              checking_--;
+              for (auto& f : missing)
+                pendingList[f.file_name_] = f;
+              copy_loop();
+            });
+          });
+    }
+    unchecked_.clear();
+  }
+  // 手元のファイルのハッシュを計算し、違っていれば転送待ちに加える
+  void verify_file(FileInfo nf)
+  {
+    verifying_++;
+    Concurrent::ThreadPool::shared().post(
+        [this, self = shared_from_this(), nf]() mutable {
+          nf.old_hash_ = MD5::calc(nf.real_path_.generic_string());
+          asio::post(strand_, [this, self, nf]() {
+            verifying_--;
+            if (nf.old_hash_ == nf.new_hash_)
+            {
+              // 内容は同じなので更新時刻だけ合わせる
+              boost::system::error_code err;
+              fs::last_write_time(nf.real_path_, nf.mtime_, err);
+              record(nf);
+              if (verboseMode)
+                std::cout << "same: " << nf.real_path_ << std::endl;
+            }
+            else
+            {
+              pendingList[nf.file_name_] = nf;
+            }
+            copy_loop();
+          });
+        });
+  }
+
+  // 差分転送するファイルの最小サイズ
+  static constexpr uintmax_t DELTA_MIN_SIZE = 1024 * 1024;
+  // 要求中の位置からどれだけ先まで先読みを依頼しておくか
+  static constexpr size_t PREFETCH_AHEAD = 64;
+
+  // 最大max_request_個まで応答を待たずに要求を出しておく
+  void copy_loop()
+  {
+    if (request_count_ == 0 && next_index_ >= fileList.size() &&
+        !pendingList.empty())
+    {
+      // 前回分が終わったので溜まっていたファイルの転送を始める
+      fileList.clear();
+      for (auto& p : pendingList)
+        fileList.push_back(p.second);
+      pendingList.clear();
+      next_index_     = 0;
+      prefetch_index_ = 0;
+      done_count_     = 0;
+    }
+    while (request_count_ < max_request_ && next_index_ < fileList.size())
+    {
+      request_count_++;
+      if (is_small(fileList[next_index_]))
+      {
+        request_bundle();
+        continue;
+      }
+      auto idx = next_index_++;
+      if (use_delta_ && fileList[idx].exists_ &&
+          fileList[idx].size_ >= DELTA_MIN_SIZE)
+        request_delta(idx);
+      else
+        request_file(idx);
+    }
+    if (prefetch_)
+      request_prefetch();
+
+    if (list_done_ && done_count_ >= fileList.size() &&
+        pendingList.empty() && verifying_ == 0 && checking_ == 0)
+    {
+      if (follow_)
+      {
+        // 以降はサーバからの変更通知を待つ
+        if (!watching_)
+          Super::send("watch", {"start"}, [&](bool) {});
+        watching_ = true;
+        return;
+      }
+      // 全転送完了
+      Super::send("finish", {"no error"}, [&](bool) {});
+      is_finished_ = true;
+    }
+  }
+  // この先で要求するファイルを知らせ、サーバに先頭を先読みさせておく
+  // (ある程度溜まってからまとめて送る)
+  void request_prefetch()
   {
-    for (; idx < fileList.size(); idx++)
+    auto first = std::max(prefetch_index_, next_index_);
+    auto last  = std::min(fileList.size(), next_index_ + PREFETCH_AHEAD);
+    if (first >= last ||
+        (last - first < PREFETCH_AHEAD / 2 && last < fileList.size()))
+      return;
+    Network::BufferList names;
+    for (auto i = first; i < last; i++)
+      names.push_back(fileList[i].file_name_);
+    prefetch_index_ = last;
+    Super::send("prefetch", names, [&](bool) {});
+  }
+  // ファイル全体を要求する
+  // 前回途中で切れたファイル(.syncpart)があれば、その続きから要求する
+  void request_file(size_t idx)
+  {
+    auto&                     fi    = fileList[idx];
+    auto                      part  = fi.real_path_.generic_string() + ".syncpart";
+    boost::system::error_code err;
+    auto                      psize = fs::file_size(part, err);
+    if (err || psize == 0 || psize >= fi.size_)
     {
-      auto& fi = fileList[idx];
-      Super::send("filereq", {fi.file_name_}, [&](bool) {
-        start_receive(fi.real_path_.generic_string(), [&]() {
-          if (fi.old_hash_.empty())
+      send_filereq(idx, part, 0, "");
+      return;
+    }
+    // 受信済み部分のハッシュをサーバ側で照合してもらう
+    Concurrent::ThreadPool::shared().post(
+        [this, self = shared_from_this(), idx, part, psize]() {
+          auto hash = MD5::calc(part, psize);
+          asio::post(strand_, [this, self, idx, part, psize, hash]() {
+            send_filereq(idx, part, psize, hash);
+          });
+        });
+  }
+  void send_filereq(size_t idx, std::string part, uintmax_t offset,
+                    std::string hash)
+  {
+    auto& fi = fileList[idx];
+    receiveFile(
+        idx,
+        part,
+        [this, idx, part](bool ok) {
+          if (!ok)
           {
-            std::cout << "create: " << fi.real_path_ << " : " << fi.new_hash_
+            // 壊れたブロックを受け取った(途中までの内容は消してある)
+            std::cerr << "receive failed: " << fileList[idx].real_path_
                       << std::endl;
+            on_copied(1);
+            return;
           }
-          else
+          boost::system::error_code err;
+          fs::rename(part, fileList[idx].real_path_, err);
+          set_mtime(idx);
+          report(idx);
+          on_copied(1);
+        },
+        true);
+    if (offset > 0 && verboseMode)
+      std::cout << "resume: " << fi.real_path_ << " from " << offset
+                << std::endl;
+    Super::send("filereq",
+                {fi.file_name_,
+                 std::to_string(idx),
+                 std::to_string(offset),
+                 hash},
+                [&](bool s) {
+                  if (!s)
+                  {
+                    is_finished_ = true;
+                  }
+                });
+  }
+  // 手元のファイルのシグネチャを送り、差分を要求する
+  void request_delta(size_t idx)
+  {
+    auto self = shared_from_this();
+    Concurrent::ThreadPool::shared().post([this, self, idx]() {
+      auto sig = std::make_shared<Network::Buffer>();
+      bool ok  = Delta::signature(fileList[idx].real_path_, *sig);
+      asio::post(strand_, [this, self, idx, sig, ok]() {
+        if (!ok)
+        {
+          request_file(idx);
+          return;
+        }
+        auto& fi    = fileList[idx];
+        auto  bsize = Delta::signatureBlockSize(*sig);
+        auto  dpath = fi.real_path_.generic_string() + ".syncdelta";
+        receiveFile(idx, dpath, [this, idx, bsize, dpath](bool ok) {
+          if (!ok)
           {
-            std::cout << "update: " << fi.real_path_ << " : " << fi.old_hash_
-                      << " -> " << fi.new_hash_ << std::endl;
+            // 差分が壊れていたらファイル全体を取り直す
+            std::cout << "delta failed: " << fileList[idx].real_path_
+                      << std::endl;
+            request_file(idx);
+            return;
           }
-          asio::post([&]() { copy_loop(idx + 1); });
+          Concurrent::ThreadPool::shared().post(
+              [this, self = shared_from_this(), idx, bsize, dpath]() {
+                apply_delta(idx, bsize, dpath);
+              });
         });
+        Super::send("deltareq",
+                    {std::to_string(idx), fi.file_name_},
+                    [&](bool s) {
+                      if (!s)
+                      {
+                        is_finished_ = true;
+                      }
+                    });
+        sendBuffer(std::move(*sig), idx, [&](bool) {});
       });
-      break;
-    }
+    });
+  }
+  // 受け取った差分からファイルを組み立てる(ワーカースレッド)
+  void apply_delta(size_t idx, uint32_t bsize, fs::path dpath)
+  {
+    auto&                     fi = fileList[idx];
+    fs::path                  npath{fi.real_path_.generic_string() + ".synctmp"};
+    boost::system::error_code err;
+    auto                      dsize = fs::file_size(dpath, err);
+    bool ok = Delta::apply(fi.real_path_, dpath, npath, bsize);
+    fs::remove(dpath, err);
+    if (ok)
+      fs::rename(npath, fi.real_path_, err);
+    else
+      fs::remove(npath, err);
+    if (verboseMode)
+      std::cout << "delta: " << fi.real_path_ << " " << dsize << "/"
+                << fi.size_ << " bytes" << std::endl;
+    asio::post(strand_, [this, self = shared_from_this(), idx, ok]() {
+      if (ok)
+      {
+        set_mtime(idx);
+        report(idx);
+        on_copied(1);
+      }
+      else
+      {
+        // 組み立てに失敗したらファイル全体を取り直す
+        std::cout << "delta failed: " << fileList[idx].real_path_ << std::endl;
+        request_file(idx);
+      }
+    });
+  }
+  bool is_small(const FileInfo& fi) const
+  {
+    return small_size_ > 0 && fi.size_ <= small_size_;
+  }
+  // 続く小さいファイルをまとめて要求する
+  void request_bundle()
+  {
+    static constexpr size_t    BUNDLE_MAX_FILES = 1024;
+    static constexpr uintmax_t BUNDLE_MAX_SIZE  = 4 * 1024 * 1024;
 
-    if (idx >= fileList.size())
+    auto                first = next_index_;
+    uintmax_t           total = 0;
+    Network::BufferList req   = {std::to_string(first)};
+    while (next_index_ < fileList.size() && req.size() <= BUNDLE_MAX_FILES)
     {
-      // 全転送完了
-      Super::send("finish", {"no error"}, [&](bool) {});
-      is_finished_ = true;
+      auto& fi = fileList[next_index_];
+      if (!is_small(fi) || (total > 0 && total + fi.size_ > BUNDLE_MAX_SIZE))
+        break;
+      total += fi.size_;
+      req.push_back(fi.file_name_);
+      next_index_++;
     }
+    auto last = next_index_;
+    receiveBuffer(first, [this, first, last](bool ok, Network::Buffer& data) {
+      if (!ok)
+      {
+        std::cerr << "broken bundle: " << fileList[first].file_name_
+                  << std::endl;
+        on_copied(last - first);
+        return;
+      }
+      // 展開・書き込みはワーカーで行う
+      auto bundle = std::make_shared<Network::Buffer>(std::move(data));
+      Concurrent::ThreadPool::shared().post([this, first, last, bundle]() {
+        extract_bundle(first, last, *bundle);
+      });
+    });
+    Super::send("bundlereq", req, [&](bool s) {
+      if (!s)
+      {
+        is_finished_ = true;
+      }
+    });
+  }
+  void extract_bundle(size_t first, size_t last, const Network::Buffer& data)
+  {
+    std::map<std::string, size_t> index;
+    for (auto i = first; i < last; i++)
+    {
+      index[fileList[i].file_name_] = i;
+    }
+    bool ok = Bundle::parse(data, [&](const Bundle::Record& rec) {
+      auto it = index.find(rec.path_);
+      if (it == index.end())
+        return;
+      auto&                     fi = fileList[it->second];
+      boost::system::error_code err;
+      fs::create_directories(fi.real_path_.parent_path(), err);
+      std::ofstream ofs(fi.real_path_.generic_string(), std::ios::binary);
+      ofs.write(rec.data_, rec.size_);
+      ofs.close();
+      // 以前途中で切れていたものは不要
+      fs::remove(fi.real_path_.generic_string() + ".syncpart", err);
+      fi.mtime_ = rec.mtime_;
+      set_mtime(it->second);
+      report(it->second);
+    });
+    if (!ok)
+    {
+      std::cerr << "broken bundle: " << fileList[first].file_name_ << std::endl;
+    }
+    asio::post(strand_, [this, first, last, self = shared_from_this()]() {
+      on_copied(last - first);
+    });
+  }
+  // サーバ側の更新時刻に合わせて、受信済みとして記録する
+  // (ワーカースレッドからも呼ばれる)
+  void set_mtime(size_t idx)
+  {
+    auto&                     fi = fileList[idx];
+    boost::system::error_code err;
+    fs::last_write_time(fi.real_path_, fi.mtime_, err);
+    if (!err)
+      record(fi);
+  }
+  //
+  void report(size_t idx)
+  {
+    auto& fi = fileList[idx];
+    if (fi.old_hash_.empty())
+    {
+      std::cout << "create: " << fi.real_path_ << " : " << fi.new_hash_
+                << std::endl;
+    }
+    else
+    {
+      std::cout << "update: " << fi.real_path_ << " : " << fi.old_hash_
+                << " -> " << fi.new_hash_ << std::endl;
+    }
+  }
+  // 1要求分(ファイル1つ、またはまとめた分)の転送完了
+  void on_copied(size_t nb_files)
+  {
+    request_count_--;
+    done_count_ += nb_files;
+    copy_loop();
   }
 };
 
@@ -237,6 +804,40 @@ main(int argc, char** argv)
       "w,without",
       "without pattern",
       cxxopts::value<std::string>()->default_value(""))(
+      "x,exclude",
+      "exclude rule: glob:<pattern>, path:<prefix>, re:<regex> or literal",
+      cxxopts::value<std::vector<std::string>>())(
+      "D,statedb",
+      "sync state database; files unchanged since the last receive are not "
+      "checked",
+      cxxopts::value<std::string>()->default_value(""))(
+      "V,verify",
+      "with --statedb, receive files again that were deleted locally",
+      cxxopts::value<bool>()->default_value("false"))(
+      "n,inflight",
+      "number of pipelined file requests",
+      cxxopts::value<int>()->default_value("16"))(
+      "f,follow",
+      "keep connected and receive changes on the server",
+      cxxopts::value<bool>()->default_value("false"))(
+      "H,hash",
+      "compare files of the same size by content hash",
+      cxxopts::value<bool>()->default_value("false"))(
+      "d,delta",
+      "receive only the differences of existing files",
+      cxxopts::value<bool>()->default_value("false"))(
+      "s,small",
+      "bundle files up to this size(KB) into one request, 0 to disable",
+      cxxopts::value<int>()->default_value("64"))(
+      "b,block",
+      "transfer block size(KB)",
+      cxxopts::value<int>()->default_value("1024"))(
+      "a,adaptive",
+      "adapt block size to the transfer speed",
+      cxxopts::value<bool>()->default_value("false"))(
+      "c,codec",
+      "compression: none, lz4[:accel], lz4hc[:level], zstd[:level]",
+      cxxopts::value<std::string>()->default_value("lz4"))(
       "v,verbose",
       "verbose mode",
       cxxopts::value<bool>()->default_value("false"));
@@ -257,13 +858,27 @@ main(int argc, char** argv)
     verboseMode = result["verbose"].as<bool>();
 
     asio::io_service io_service;
-    Client           client(io_service);
+    auto             client     = std::make_shared<Client>(io_service);
     auto             output_dir = result["output"].as<std::string>();
-    auto             w  = std::make_shared<asio::io_service::work>(io_service);
-    auto             th = std::thread([&]() { io_service.run(); });
+    // 記録を開けなければ(エラーは表示済み)、記録無しで続けずに終える
+    auto statedb = result["statedb"].as<std::string>();
+    if (!statedb.empty() && !client->openState(statedb))
+      return 1;
+    auto w  = std::make_shared<asio::io_service::work>(io_service);
+    auto th = std::thread([&]() { io_service.run(); });
     // 接続
-    client.start(hostname, output_dir);
-    while (client.isConnect() == false)
+    client->setTransferBlock(result["block"].as<int>() * size_t(1024),
+                             result["adaptive"].as<bool>(),
+                             Codec::parse(result["codec"].as<std::string>()));
+    client->setDelta(result["delta"].as<bool>());
+    client->setFollow(result["follow"].as<bool>());
+    client->setHash(result["hash"].as<bool>());
+    client->setVerify(result["verify"].as<bool>());
+    client->start(hostname,
+                  output_dir,
+                  result["inflight"].as<int>(),
+                  result["small"].as<int>() * uintmax_t(1024));
+    while (client->isConnect() == false)
     {
       std::this_thread::sleep_for(std::chrono::milliseconds(1));
     }
@@ -271,9 +886,14 @@ main(int argc, char** argv)
     Network::BufferList req;
     req.push_back(result["request"].as<std::string>());
     req.push_back(result["without"].as<std::string>());
-    client.requestFileList(req);
+    if (result.count("exclude"))
+    {
+      for (auto& x : result["exclude"].as<std::vector<std::string>>())
+        req.push_back(x);
+    }
+    client->requestFileList(req);
     // 転送待ち
-    while (client.isFinished() == false)
+    while (client->isFinished() == false)
     {
       std::this_thread::sleep_for(std::chrono::milliseconds(1));
     }
@@ -0,0 +1,104 @@
+//
+// 受信済みファイルの記録(前回受け取った時のサーバ側の状態)
+//
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+#include <ctime>
+#include <iostream>
+#include <leveldb/db.h>
+#include <memory>
+#include <string>
+
+// 記録と同じ状態のファイルが一覧で届いた場合は、手元のファイルを調べずに済ませる
+// (手元で書き換えたファイルは、サーバ側で変更されるまで受け取り直さない)
+// キーは手元のフルパス、値は"更新時刻 サイズ ハッシュ"
+namespace State
+{
+struct Record
+{
+  std::time_t mtime_ = 0; // サーバ側の更新時刻
+  uintmax_t   size_  = 0;
+  std::string hash_; // 無ければ空
+
+  bool operator==(const Record& o) const
+  {
+    return mtime_ == o.mtime_ && size_ == o.size_ && hash_ == o.hash_;
+  }
+};
+
+class StateDB
+{
+  std::unique_ptr<leveldb::DB> db_;
+
+public:
+  /// 開く(無ければ作る)
+  bool open(const std::string& path)
+  {
+    leveldb::Options opts;
+    opts.create_if_missing = true;
+    leveldb::DB* db;
+    auto         status = leveldb::DB::Open(opts, path, &db);
+    if (!status.ok())
+    {
+      std::cerr << "state db: " << status.ToString() << std::endl;
+      return false;
+    }
+    db_.reset(db);
+    return true;
+  }
+  bool isOpen() const { return bool(db_); }
+
+  bool get(const std::string& path, Record& rec) const
+  {
+    std::string value;
+    if (!db_ || !db_->Get(leveldb::ReadOptions(), path, &value).ok())
+      return false;
+    return decode(value, rec);
+  }
+  /// 記録(複数のスレッドから呼んでよい)
+  void put(const std::string& path, const Record& rec)
+  {
+    if (!db_)
+      return;
+    auto value = std::to_string(rec.mtime_) + " " + std::to_string(rec.size_) +
+                 " " + rec.hash_;
+    db_->Put(leveldb::WriteOptions(), path, value);
+  }
+  /// prefixで始まるパスの記録を順に渡す
+  template <class Func>
+  void each(const std::string& prefix, Func func) const
+  {
+    if (!db_)
+      return;
+    std::unique_ptr<leveldb::Iterator> it{
+        db_->NewIterator(leveldb::ReadOptions())};
+    for (it->Seek(prefix); it->Valid(); it->Next())
+    {
+      auto key = it->key().ToString();
+      if (key.compare(0, prefix.size(), prefix) != 0)
+        break;
+      Record rec;
+      if (decode(it->value().ToString(), rec))
+        func(key, rec);
+    }
+  }
+
+private:
+  static bool decode(const std::string& value, Record& rec)
+  {
+    auto p   = value.data();
+    auto end = p + value.size();
+    auto r1  = std::from_chars(p, end, rec.mtime_);
+    if (r1.ec != std::errc() || r1.ptr == end)
+      return false;
+    auto r2 = std::from_chars(r1.ptr + 1, end, rec.size_);
+    if (r2.ec != std::errc())
+      return false;
+    rec.hash_.assign(r2.ptr == end ? end : r2.ptr + 1, end);
+    return true;
+  }
+};
+
+} // namespace State
@@ -0,0 +1,103 @@
+//
+// データベースへの書き込みをまとめる
+//
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <leveldb/db.h>
+#include <leveldb/write_batch.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// ワーカーからの書き込みを溜めて、専用のスレッドがWriteBatchでまとめて書く
+// (一定の大きさになるか一定時間ごと。最後は同期書き込みで確定させる)
+// 溜めている間の値はGetでは見えないので、書いたキーを同じ実行中に読まないこと
+namespace Commit
+{
+class Committer
+{
+  static constexpr size_t BATCH_BYTES = 1024 * 1024;
+  static constexpr auto   INTERVAL    = std::chrono::milliseconds(200);
+
+  leveldb::DB*                         db_;
+  std::unique_ptr<leveldb::WriteBatch> pending_;
+  size_t                               empty_size_; // 空のバッチの大きさ
+  std::mutex                           lock_;
+  std::condition_variable              cond_;
+  bool                                 finish_ = false;
+  bool                                 failed_ = false;
+  std::thread                          thread_;
+
+public:
+  explicit Committer(leveldb::DB* db)
+      : db_(db), pending_(std::make_unique<leveldb::WriteBatch>()),
+        empty_size_(pending_->ApproximateSize())
+  {
+    thread_ = std::thread([this]() { run(); });
+  }
+  ~Committer() { close(); }
+
+  /// 書き込みを頼む(複数のスレッドから呼んでよい)
+  void put(const std::string& key, const std::string& value)
+  {
+    bool full;
+    {
+      std::lock_guard<std::mutex> l(lock_);
+      pending_->Put(key, value);
+      full = pending_->ApproximateSize() >= BATCH_BYTES;
+    }
+    if (full)
+      cond_.notify_one();
+  }
+
+  /// 残りをすべて書いて確定させる(失敗していればfalse)
+  bool close()
+  {
+    {
+      std::lock_guard<std::mutex> l(lock_);
+      if (finish_)
+        return !failed_;
+      finish_ = true;
+    }
+    cond_.notify_one();
+    thread_.join();
+    return !failed_;
+  }
+
+private:
+  void run()
+  {
+    std::unique_lock<std::mutex> l(lock_);
+    for (;;)
+    {
+      cond_.wait_for(l, INTERVAL, [this]() {
+        return finish_ || pending_->ApproximateSize() >= BATCH_BYTES;
+      });
+      bool last = finish_;
+      // 溜まっていなければ書かない(最後は確定させるために同期書き込みする)
+      if (!last && pending_->ApproximateSize() == empty_size_)
+        continue;
+      auto batch = std::make_unique<leveldb::WriteBatch>();
+      batch.swap(pending_);
+      l.unlock();
+      // 書いている間もワーカーは次のバッチに溜められる
+      leveldb::WriteOptions opts;
+      opts.sync   = last;
+      auto status = db_->Write(opts, batch.get());
+      l.lock();
+      if (!status.ok())
+      {
+        std::cerr << "db write: " << status.ToString() << std::endl;
+        failed_ = true;
+      }
+      if (last)
+        break;
+    }
+  }
+};
+
+} // namespace Commit
@@ -0,0 +1,257 @@
+//
+// ファイルのコピー
+//
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <boost/system/error_code.hpp>
+#if defined(__linux__)
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <memory>
+#include <mutex>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <threadpool.hpp>
+#include <unistd.h>
+#endif
+
+// 使える中で速い方法から順に試してコピーする
+//  clone    : CoWのファイルシステム(btrfs, XFSなど)で中身を共有する(FICLONE)
+//  range    : カーネル内でコピーする(copy_file_range)
+//  sendfile : 同上(copy_file_rangeが使えない場合)
+//  rw       : 読んで書く
+// clone以外では、大きいファイルを範囲に分けて複数のスレッドでコピーする
+namespace CopyEngine
+{
+namespace fs = boost::filesystem;
+
+enum class Method
+{
+  Clone,
+  Range,
+  SendFile,
+  ReadWrite,
+};
+
+inline const char*
+toString(Method m)
+{
+  switch (m)
+  {
+  case Method::Clone:
+    return "clone";
+  case Method::Range:
+    return "range";
+  case Method::SendFile:
+    return "sendfile";
+  default:
+    return "rw";
+  }
+}
+
+#if defined(__linux__)
+namespace detail
+{
+// これより大きいファイルは範囲に分けて並列にコピーする
+static constexpr uint64_t PARALLEL_MIN = 64 * 1024 * 1024;
+static constexpr uint64_t RANGE_SIZE   = 16 * 1024 * 1024;
+static constexpr size_t   IO_SIZE      = 1024 * 1024;
+// コピー中に元ファイルが短くなった(残りを穴のまま成功にしない)
+static constexpr int SHRUNK = ENODATA;
+
+struct File
+{
+  int fd_ = -1;
+  ~File()
+  {
+    if (fd_ >= 0)
+      ::close(fd_);
+  }
+};
+
+// ファイルシステムやカーネルが対応していない
+inline bool
+unsupported(int e)
+{
+  return e == ENOSYS || e == EXDEV || e == EINVAL || e == EOPNOTSUPP;
+}
+
+/// [ofs, ofs + len)を読んで書く(失敗したらerrno)
+inline int
+readWrite(int in, int out, uint64_t ofs, uint64_t len)
+{
+  std::unique_ptr<char[]> buff(new char[IO_SIZE]);
+  while (len > 0)
+  {
+    auto nb = ::pread(in, buff.get(), std::min<uint64_t>(len, IO_SIZE), ofs);
+    if (nb < 0 && errno == EINTR)
+      continue;
+    if (nb < 0)
+      return errno;
+    if (nb == 0)
+      return SHRUNK;
+    for (ssize_t done = 0; done < nb;)
+    {
+      auto wb = ::pwrite(out, buff.get() + done, nb - done, ofs + done);
+      if (wb < 0 && errno == EINTR)
+        continue;
+      if (wb < 0)
+        return errno;
+      done += wb;
+    }
+    ofs += nb;
+    len -= nb;
+  }
+  return 0;
+}
+
+/// [ofs, ofs + len)をcopy_file_rangeでコピーする
+/// 使えなければmethodをReadWriteにして、fallbackなら読んで書くコピーに
+/// 切り替える(fallbackでなければ何もコピーせずに返す)
+inline int
+copyRange(int in, int out, uint64_t ofs, uint64_t len, Method& method,
+          bool fallback)
+{
+  loff_t in_ofs  = ofs;
+  loff_t out_ofs = ofs;
+  while (method == Method::Range && len > 0)
+  {
+    auto nb = ::copy_file_range(in, &in_ofs, out, &out_ofs, len, 0);
+    if (nb < 0 && errno == EINTR)
+      continue;
+    if (nb < 0 && unsupported(errno) && uint64_t(in_ofs) == ofs)
+      method = Method::ReadWrite;
+    else if (nb < 0)
+      return errno;
+    else if (nb == 0)
+      return SHRUNK;
+    else
+      len -= nb;
+  }
+  return len > 0 && fallback ? readWrite(in, out, in_ofs, len) : 0;
+}
+
+/// 先頭から順にコピーする
+inline int
+copySequential(int in, int out, uint64_t size, Method& method)
+{
+  method  = Method::Range;
+  auto rc = copyRange(in, out, 0, size, method, false);
+  if (rc != 0 || method == Method::Range)
+    return rc;
+  // copy_file_rangeが使えなければsendfileを試す(出力はファイルの現在位置)
+  method    = Method::SendFile;
+  off_t ofs = 0;
+  while (uint64_t(ofs) < size)
+  {
+    auto nb = ::sendfile(out, in, &ofs, size - ofs);
+    if (nb < 0 && errno == EINTR)
+      continue;
+    if (nb < 0 && unsupported(errno) && ofs == 0)
+    {
+      method = Method::ReadWrite;
+      return readWrite(in, out, 0, size);
+    }
+    if (nb < 0)
+      return errno;
+    if (nb == 0)
+      return SHRUNK;
+  }
+  return 0;
+}
+
+/// 範囲に分けて共通のスレッドプールでコピーする(先頭の範囲は呼び出し側で)
+inline int
+copyParallel(int in, int out, uint64_t size, Method& method)
+{
+  if (::ftruncate(out, size) != 0)
+    return errno;
+  struct Join
+  {
+    std::mutex              lock_;
+    std::condition_variable cond_;
+    size_t                  left_;
+    int                     error_ = 0;
+    std::atomic_bool        fallback_{false};
+  } join;
+  auto copy_one = [&, in, out, size](uint64_t ofs) {
+    Method m  = Method::Range;
+    auto   rc =
+        copyRange(in, out, ofs, std::min(RANGE_SIZE, size - ofs), m, true);
+    if (m != Method::Range)
+      join.fallback_ = true;
+    return rc;
+  };
+
+  join.left_ = (size + RANGE_SIZE - 1) / RANGE_SIZE - 1;
+  for (auto ofs = RANGE_SIZE; ofs < size; ofs += RANGE_SIZE)
+  {
+    Concurrent::ThreadPool::shared().post([&, ofs]() {
+      auto                        rc = copy_one(ofs);
+      std::lock_guard<std::mutex> l(join.lock_);
+      if (rc != 0)
+        join.error_ = rc;
+      // 待っている側がjoinを破棄するので、ロックしたまま知らせる
+      if (--join.left_ == 0)
+        join.cond_.notify_one();
+    });
+  }
+  auto                         rc = copy_one(0);
+  std::unique_lock<std::mutex> l(join.lock_);
+  join.cond_.wait(l, [&]() { return join.left_ == 0; });
+  method = join.fallback_ ? Method::ReadWrite : Method::Range;
+  return rc != 0 ? rc : join.error_;
+}
+} // namespace detail
+
+/// srcをdstにコピーする(dstは作り直す。失敗した場合はerrに)
+inline Method
+copy(const fs::path& src, const fs::path& dst, boost::system::error_code& err)
+{
+  auto fail = [&](int e) {
+    err.assign(e, boost::system::system_category());
+    return Method::ReadWrite;
+  };
+  detail::File in;
+  in.fd_ = ::open(src.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (in.fd_ < 0 || ::fstat(in.fd_, &st) != 0)
+    return fail(errno);
+  detail::File out;
+  out.fd_ =
+      ::open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (out.fd_ < 0)
+    return fail(errno);
+  // 元ファイルと同じ権限にする(umaskによらない)
+  if (::fchmod(out.fd_, st.st_mode & 07777) != 0)
+    return fail(errno);
+
+  if (::ioctl(out.fd_, FICLONE, in.fd_) == 0)
+    return Method::Clone;
+
+  uint64_t size   = st.st_size;
+  Method   method = Method::Range;
+  auto     rc     = size >= detail::PARALLEL_MIN
+                        ? detail::copyParallel(in.fd_, out.fd_, size, method)
+                        : detail::copySequential(in.fd_, out.fd_, size, method);
+  if (rc != 0)
+    return fail(rc);
+  return method;
+}
+#else
+inline Method
+copy(const fs::path& src, const fs::path& dst, boost::system::error_code& err)
+{
+  fs::copy_file(src, dst, fs::copy_option::overwrite_if_exists, err);
+  return Method::ReadWrite;
+}
+#endif
+
+} // namespace CopyEngine
@@ -0,0 +1,62 @@
+//
+// 元ファイルの記録(前回ハッシュを計算した時の属性とハッシュ)
+//
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+#include <filestat.hpp>
+#include <string>
+
+// 属性が記録と同じファイルは読まずに前回のハッシュを使う
+// 値は"サイズ 更新時刻(ナノ秒) iノード ハッシュ"
+// (以前の版の値はハッシュだけなので、属性は0として読む)
+namespace FileRecord
+{
+struct Record
+{
+  uintmax_t   size_     = 0;
+  int64_t     mtime_ns_ = 0;
+  uint64_t    ino_      = 0;
+  std::string hash_;
+
+  bool sameMeta(const FileStat::Stat& st) const
+  {
+    return size_ == st.size_ && mtime_ns_ == st.mtime_ns_ && ino_ == st.ino_;
+  }
+};
+
+inline std::string
+encode(const FileStat::Stat& st, const std::string& hash)
+{
+  return std::to_string(st.size_) + " " + std::to_string(st.mtime_ns_) + " " +
+         std::to_string(st.ino_) + " " + hash;
+}
+
+inline Record
+decode(const std::string& value)
+{
+  Record rec;
+  auto   p   = value.data();
+  auto   end = p + value.size();
+  auto   r1  = std::from_chars(p, end, rec.size_);
+  if (r1.ec == std::errc() && r1.ptr < end && *r1.ptr == ' ')
+  {
+    auto r2 = std::from_chars(r1.ptr + 1, end, rec.mtime_ns_);
+    if (r2.ec == std::errc() && r2.ptr < end && *r2.ptr == ' ')
+    {
+      auto r3 = std::from_chars(r2.ptr + 1, end, rec.ino_);
+      if (r3.ec == std::errc() && r3.ptr < end && *r3.ptr == ' ')
+      {
+        rec.hash_.assign(r3.ptr + 1, end);
+        return rec;
+      }
+    }
+  }
+  // 以前の形式
+  rec       = Record{};
+  rec.hash_ = value;
+  return rec;
+}
+
+} // namespace FileRecord
@@ -5,22 +5,28 @@
 #include <array>
 #include <atomic>
 #include <boost/filesystem.hpp>
-#include <boost/range/iterator_range.hpp>
-#include <boost/uuid/detail/md5.hpp>
+#include <charconv>
 #include <condition_variable>
 #include <cstdio>
 #include <cxxopts.hpp>
+#include <dirwalk.hpp>
+#include <filehash.hpp>
+#include <filter.hpp>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <iterator>
 #include <leveldb/db.h>
 #include <list>
-#include <md5.hpp>
 #include <memory>
 #include <queue>
 #include <string>
 #include <thread>
+#include <vector>
+
+#include "committer.hpp"
+#include "copyengine.hpp"
+#include "filerecord.hpp"
 
 namespace
 {
@@ -41,9 +47,11 @@ std::condition_variable qCond;
 std::atomic_bool        qFinish{false};
 std::atomic_int         qCount{0};
 
-bool useTimeStamp = false;
-bool checkOnly    = false;
-bool verboseMode  = false;
+bool           useTimeStamp = false;
+bool           checkOnly    = false;
+bool           verboseMode  = false;
+bool           paranoidMode = false; // 属性が同じでもハッシュを計算し直す
+FileHash::Algo hashAlgo     = FileHash::Algo::XXH64;
 
 //
 struct FileInfo : public Queue
@@ -63,10 +71,11 @@ struct FileInfo : public Queue
 //
 struct CheckInfo : public Queue
 {
-  fs::path    src_path_;
-  fs::path    dst_dir_;
-  std::string pathstr_;
-  size_t      pathlen_;
+  fs::path       src_path_;
+  fs::path       dst_dir_;
+  std::string    pathstr_;
+  size_t         pathlen_;
+  FileStat::Stat stat_; // 走査した時の属性
 
   ~CheckInfo() = default;
 
@@ -74,8 +83,9 @@ struct CheckInfo : public Queue
   void execute() override { check(); }
 };
 
-std::unique_ptr<leveldb::DB> db;
-leveldb::Options             dbopts;
+std::unique_ptr<leveldb::DB>       db;
+leveldb::Options                   dbopts;
+std::unique_ptr<Commit::Committer> committer; // dbへの書き込み
 
 //
 void
@@ -91,8 +101,20 @@ FileInfo::copy()
   }
   std::cout << "[Update]: " << dpath << std::endl;
   fs::remove(dst_path_);
-  fs::copy_file(src_path_, dst_path_);
-  db->Put(leveldb::WriteOptions(), dpath.generic_string(), hash_);
+  boost::system::error_code err;
+  auto method = CopyEngine::copy(src_path_, dst_path_, err);
+  if (err)
+  {
+    // 中途半端なファイルを残さない(次回は無いファイルとしてコピーし直す)
+    std::cerr << "copy error: " << dpath << ": " << err.message() << std::endl;
+    fs::remove(dst_path_, err);
+    --qCount;
+    return;
+  }
+  if (verboseMode)
+    std::cout << "[copy " << CopyEngine::toString(method) << "]: " << dpath
+              << std::endl;
+  committer->put(dpath.generic_string(), hash_);
   --qCount;
 }
 
@@ -103,31 +125,64 @@ CheckInfo::check()
   auto srcabs = src_path_;
   auto srcstr = srcabs.generic_string();
 
+  std::string old_hash;
+  auto        s      = db->Get(leveldb::ReadOptions(), srcstr, &old_hash);
   std::string hash;
-  uint64_t    hash_num = 0;
+  std::string value; // 記録する値
+  bool        update = !s.ok();
+  bool        store  = false; // 変更が無くても記録し直す
   if (useTimeStamp)
   {
-    hash_num = fs::last_write_time(src_path_);
-    hash     = std::to_string(hash_num);
+    uint64_t hash_num = fs::last_write_time(src_path_);
+    hash              = std::to_string(hash_num);
+    value             = hash;
+    if (s.ok())
+    {
+      // 全体が数値でなければ(内容のハッシュの記録)更新とみなす
+      uint64_t old_num = 0;
+      auto     end     = old_hash.data() + old_hash.size();
+      auto     r       = std::from_chars(old_hash.data(), end, old_num);
+      update = r.ec != std::errc() || r.ptr != end || hash_num > old_num;
+    }
   }
   else
   {
-    hash = MD5::calc(srcstr);
+    auto old      = FileRecord::decode(old_hash);
+    auto old_algo = s.ok() ? FileHash::algoOf(old.hash_) : std::nullopt;
+    if (s.ok() && !paranoidMode && old_algo == hashAlgo &&
+        old.sameMeta(stat_))
+    {
+      // 属性が前回と同じなら読まずに前回のハッシュを使う
+      hash = old.hash_;
+    }
+    else
+    {
+      // 記録と方式が違う場合は、同じ読み込みで記録の方式のハッシュも計算して
+      // 変更を判定し、記録は今の方式に置き換える
+      std::vector<FileHash::Algo> algos{hashAlgo};
+      if (old_algo && *old_algo != hashAlgo)
+        algos.push_back(*old_algo);
+      auto hashes = FileHash::calc(srcstr, algos);
+      if (hashes.empty())
+      {
+        std::cerr << "read error: " << srcstr << std::endl;
+        --qCount;
+        return;
+      }
+      hash = hashes[0];
+      if (s.ok())
+        update = hashes.back() != FileHash::normalize(old.hash_);
+    }
+    // 属性は読む前に取ったものなので、読んでいる間に書き換えられても
+    // 次回は属性が違って読み直す
+    value = FileRecord::encode(stat_, hash);
+    store = value != old_hash;
   }
-  auto check_hash = [&](auto old) {
-    if (useTimeStamp)
-      return hash_num > std::stoull(old);
-    return hash != old;
-  };
 
-  std::string old_hash;
-  auto        s      = db->Get(leveldb::ReadOptions(), srcstr, &old_hash);
-  bool        update = false;
-  if (!s.ok() || check_hash(old_hash))
+  if (update || store)
   {
     // new file or update
-    db->Put(leveldb::WriteOptions(), srcstr, hash);
-    update = true;
+    committer->put(srcstr, value);
     if (update && verboseMode)
       std::cout << "[db update]: " << srcstr << std::endl;
   }
@@ -199,7 +254,8 @@ workThread()
 
 // ファイルリスト作成
 void
-copyFiles(fs::path path, fs::path dstpath)
+copyFiles(fs::path path, fs::path dstpath, const std::string& pattern,
+          const std::vector<std::string>& excludes)
 {
   fs::path abspath;
   if (path.filename() == ".")
@@ -210,24 +266,30 @@ copyFiles(fs::path path, fs::path dstpath)
   auto pathstr = abspath.generic_string();
   auto pathlen = pathstr.length();
 
-  auto dir =
-      boost::make_iterator_range(fs::recursive_directory_iterator(abspath), {});
-  for (const auto& e : dir)
+  // 対象・除外ルール(-pも-xと同じ書式)
+  Filter::Filter filter{abspath};
+  if (!pattern.empty())
+    filter.include(pattern);
+  for (auto& x : excludes)
+    filter.exclude(x);
+
+  // 除外されるディレクトリには入らない
+  Walk::Options opt;
+  opt.filter_ = &filter;
+  for (const auto& e : Walk::parallel(abspath, opt))
   {
-    if (!fs::is_directory(e))
+    qCount++;
+    auto chinfo       = std::make_shared<CheckInfo>();
+    chinfo->src_path_ = abspath / e.path_;
+    chinfo->dst_dir_  = dstpath;
+    chinfo->pathstr_  = pathstr;
+    chinfo->pathlen_  = pathlen;
+    chinfo->stat_     = e;
     {
-      qCount++;
-      auto chinfo       = std::make_shared<CheckInfo>();
-      chinfo->src_path_ = e.path();
-      chinfo->dst_dir_  = dstpath;
-      chinfo->pathstr_  = pathstr;
-      chinfo->pathlen_  = pathlen;
-      {
-        std::lock_guard<std::mutex> l(qLock);
-        workList.push(chinfo);
-      }
-      qCond.notify_one();
+      std::lock_guard<std::mutex> l(qLock);
+      workList.push(chinfo);
     }
+    qCond.notify_one();
   }
   //
   for (;;)
@@ -269,13 +331,22 @@ main(int argc, char** argv)
       "t,time",
       "check time stamp",
       cxxopts::value<bool>()->default_value("false"))(
+      "hash",
+      "hash for content check: xxh64 or md5",
+      cxxopts::value<std::string>()->default_value("xxh64"))(
+      "paranoid",
+      "rehash files even if size, mtime and inode are unchanged",
+      cxxopts::value<bool>()->default_value("false"))(
       "v,verbose",
       "verbose mode",
       cxxopts::value<bool>()->default_value("false"))(
       "c,check", "check only", cxxopts::value<bool>()->default_value("false"))(
       "p,pattern",
       "matching pattern for copy files",
-      cxxopts::value<std::string>()->default_value(""));
+      cxxopts::value<std::string>()->default_value(""))(
+      "x,exclude",
+      "exclude rule: glob:<pattern>, path:<prefix>, re:<regex> or literal",
+      cxxopts::value<std::vector<std::string>>());
 
   options.parse_positional({"src", "dst", "args"});
 
@@ -327,11 +398,22 @@ main(int argc, char** argv)
       useTimeStamp = result["time"].as<bool>();
       checkOnly    = result["check"].as<bool>();
       verboseMode  = result["verbose"].as<bool>();
+      paranoidMode = result["paranoid"].as<bool>();
+      hashAlgo     = FileHash::parse(result["hash"].as<std::string>());
       if (verboseMode)
         std::cout << "number of job: " << nb_thread << std::endl;
       auto ndb = std::unique_ptr<leveldb::DB>{tdb};
       db.swap(ndb);
-      copyFiles(srcpath, dstpath);
+      committer = std::make_unique<Commit::Committer>(db.get());
+      std::vector<std::string> excludes;
+      if (result.count("exclude"))
+        excludes = result["exclude"].as<std::vector<std::string>>();
+      copyFiles(srcpath,
+                dstpath,
+                result["pattern"].as<std::string>(),
+                excludes);
+      if (!committer->close())
+        ret = 1;
     }
   }
   catch (std::exception& e)
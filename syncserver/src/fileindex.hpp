@@ -0,0 +1,468 @@
+//
+// 配信ディレクトリのファイル一覧(メモリ上に保持)
+//
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
+#include <cstdint>
+#include <ctime>
+#include <dirtree.hpp>
+#include <dirwalk.hpp>
+#include <filestat.hpp>
+#include <filter.hpp>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <threadpool.hpp>
+#include <unordered_map>
+#include <vector>
+#if defined(__linux__)
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace Index
+{
+namespace asio = boost::asio;
+namespace fs   = boost::filesystem;
+
+using Entry = FileStat::Stat;
+// 相対パス -> 情報(パス順)
+using EntryMap = std::map<std::string, Entry>;
+// 変更通知(変更・追加・削除された相対パス、空なら全体が変わった可能性がある)
+// falseを返すと以降は通知しない
+using PathList = std::vector<std::string>;
+using Listener = std::function<bool(const PathList&)>;
+using TreePtr  = std::shared_ptr<const DirTree::Tree>;
+
+// 初回に一度だけディレクトリを走査し、以降はinotifyの通知で差分更新する
+// inotifyが使えない環境では要求の度に走査し直す
+// フィルタで除外されるディレクトリは走査も監視もしない
+class FileIndex : public std::enable_shared_from_this<FileIndex>
+{
+  asio::io_service&         io_service_;
+  fs::path                  root_;
+  std::string               root_str_;
+  Filter::Filter            filter_;
+  mutable std::shared_mutex lock_;
+  EntryMap                  entries_;
+  TreePtr                   tree_; // entries_の要約(変更されたら作り直す)
+  bool                      built_;
+  bool                      watching_;
+  std::mutex                build_lock_;
+  std::mutex                listener_lock_;
+  std::vector<Listener>     listeners_;
+#if defined(__linux__)
+  static constexpr uint32_t WATCH_MASK =
+      IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB |
+      IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_ONLYDIR;
+
+  using EventBuffer = std::array<char, 64 * 1024>;
+
+  int                                  inotify_fd_;
+  int                                  generation_; // 監視をやり直した回数
+  asio::posix::stream_descriptor       stream_;
+  std::unordered_map<int, std::string> watch_dirs_; // wd -> 相対パス
+  std::mutex                           watch_lock_;
+#endif
+
+public:
+  FileIndex(asio::io_service& io_service, fs::path root,
+            Filter::Filter filter)
+      : io_service_(io_service), root_(root), root_str_(root.generic_string()),
+        filter_(std::move(filter)), built_(false), watching_(false)
+#if defined(__linux__)
+        ,
+        inotify_fd_(-1), generation_(0), stream_(io_service)
+#endif
+  {
+  }
+  ~FileIndex()
+  {
+#if defined(__linux__)
+    boost::system::error_code err;
+    stream_.close(err);
+#endif
+  }
+
+  const fs::path& root() const { return root_; }
+
+  /// 最新の一覧(必要なら走査する)
+  EntryMap snapshot()
+  {
+    {
+      std::lock_guard<std::mutex> l(build_lock_);
+      if (!built_ || !watching_)
+      {
+        rebuild();
+      }
+    }
+    std::shared_lock<std::shared_mutex> l(lock_);
+    return entries_;
+  }
+  /// 一覧をまとまりごとにfuncに渡す(funcは複数のスレッドから同時に呼ばれる)
+  /// 走査し直す場合は、走査の完了を待たずに見つかった分から渡す
+  void list(const Walk::FilesFunc& func)
+  {
+    {
+      std::lock_guard<std::mutex> l(build_lock_);
+      if (!built_ || !watching_)
+      {
+        rebuild(func);
+        return;
+      }
+    }
+    static constexpr size_t LIST_CHUNK = 1024;
+
+    std::vector<Walk::EntryList> chunks;
+    {
+      std::shared_lock<std::shared_mutex> l(lock_);
+      for (auto& e : entries_)
+      {
+        if (chunks.empty() || chunks.back().size() >= LIST_CHUNK)
+        {
+          chunks.emplace_back();
+          chunks.back().reserve(LIST_CHUNK);
+        }
+        Walk::Entry ent;
+        static_cast<Entry&>(ent) = e.second;
+        ent.path_                = e.first;
+        chunks.back().push_back(std::move(ent));
+      }
+    }
+    Concurrent::StealingPool pool{Walk::defaultThreads()};
+    pool.run([&]() {
+      for (auto& c : chunks)
+        pool.spawn([&func, chunk = &c]() { func(*chunk); });
+    });
+  }
+  /// ディレクトリごとの要約(必要なら走査する)
+  TreePtr tree()
+  {
+    {
+      std::lock_guard<std::mutex> l(build_lock_);
+      if (!built_ || !watching_)
+      {
+        rebuild();
+      }
+    }
+    std::unique_lock<std::shared_mutex> l(lock_);
+    if (!tree_)
+    {
+      auto tree = std::make_shared<DirTree::Tree>();
+      for (auto& e : entries_)
+        tree->add(e.first, e.second);
+      tree->finish();
+      tree_ = tree;
+    }
+    return tree_;
+  }
+  /// 1ファイル分の情報(無ければfalse)
+  bool find(const std::string& rel, Entry& ent) const
+  {
+    std::shared_lock<std::shared_mutex> l(lock_);
+    auto                                it = entries_.find(rel);
+    if (it == entries_.end())
+      return false;
+    ent = it->second;
+    return true;
+  }
+  /// 変更通知を受け取る(監視できない環境ではfalse)
+  bool subscribe(Listener listener)
+  {
+    {
+      std::lock_guard<std::mutex> l(build_lock_);
+      if (!watching_)
+        return false;
+    }
+    std::lock_guard<std::mutex> l(listener_lock_);
+    listeners_.push_back(std::move(listener));
+    return true;
+  }
+
+private:
+  std::string relative(const fs::path& p) const
+  {
+    auto pstr = p.generic_string();
+    auto rlen = root_str_.length();
+    if (pstr.length() <= rlen)
+      return {};
+    return pstr.substr(pstr[rlen] == '/' ? rlen + 1 : rlen);
+  }
+
+  void notify(const PathList& changed)
+  {
+    std::lock_guard<std::mutex> l(listener_lock_);
+    listeners_.erase(std::remove_if(listeners_.begin(),
+                                    listeners_.end(),
+                                    [&](auto& f) { return !f(changed); }),
+                     listeners_.end());
+  }
+
+  // 全体を走査し直す(funcには走査中に見つかった分から渡す)
+  void rebuild(const Walk::FilesFunc& func = {})
+  {
+    EntryMap entries;
+    watching_ = start_watch();
+    scan({}, entries, func);
+    {
+      std::unique_lock<std::shared_mutex> l(lock_);
+      entries_.swap(entries);
+      tree_.reset();
+    }
+    built_ = true;
+  }
+
+  // base(相対パス)以下を並列に走査してentriesに追加(ディレクトリは監視に加える)
+  void scan(const std::string& base, EntryMap& entries,
+            const Walk::FilesFunc& func = {})
+  {
+    Walk::Options opt;
+    opt.base_     = base;
+    opt.filter_   = &filter_;
+    opt.on_dir_   = [this](auto& d) { add_watch(d); };
+    opt.on_files_ = func;
+    for (auto& e : Walk::parallel(root_, opt))
+    {
+      entries.emplace_hint(entries.end(), std::move(e.path_), e);
+    }
+  }
+
+#if defined(__linux__)
+  bool start_watch()
+  {
+    boost::system::error_code err;
+    stream_.close(err);
+    watch_dirs_.clear();
+    inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd_ < 0)
+      return false;
+    stream_.assign(inotify_fd_);
+    read_events(++generation_, std::make_shared<EventBuffer>());
+    return true;
+  }
+  // 走査中は複数のワーカーから呼ばれる
+  void add_watch(const fs::path& dir)
+  {
+    if (inotify_fd_ < 0)
+      return;
+    int wd = inotify_add_watch(
+        inotify_fd_, dir.generic_string().c_str(), WATCH_MASK);
+    std::lock_guard<std::mutex> l(watch_lock_);
+    if (wd >= 0)
+      watch_dirs_[wd] = relative(dir);
+    else
+      std::cerr << "inotify_add_watch failed: " << dir << std::endl;
+  }
+  void read_events(int gen, std::shared_ptr<EventBuffer> buffer)
+  {
+    // 使われなくなって破棄された後に完了が届くことがあるのでweak_ptrで持つ
+    stream_.async_read_some(
+        asio::buffer(*buffer),
+        [weak = weak_from_this(), gen, buffer](auto& err, auto bytes) {
+          if (err)
+            return;
+          // 新しいディレクトリの走査などでioスレッドを止めないよう、
+          // 反映は専用のスレッドで行う(読み込みは反映し終えてから再開する)
+          updater().post([weak, gen, buffer, bytes]() {
+            if (auto self = weak.lock())
+              self->on_events(gen, buffer, bytes);
+          });
+        });
+  }
+  // 通知を反映するスレッド(通知の順序を保つため1本)
+  static Concurrent::ThreadPool& updater()
+  {
+    static Concurrent::ThreadPool pool{1};
+    return pool;
+  }
+  void on_events(int gen, std::shared_ptr<EventBuffer> buffer, size_t bytes)
+  {
+    std::lock_guard<std::mutex> bl(build_lock_);
+    if (gen != generation_)
+    {
+      // 走査し直す前の監視からの通知は捨てる
+      return;
+    }
+    PathList changed;
+    for (size_t ofs = 0; ofs < bytes;)
+    {
+      auto ev = reinterpret_cast<const inotify_event*>(&(*buffer)[ofs]);
+      ofs += sizeof(inotify_event) + ev->len;
+      if (ev->mask & IN_Q_OVERFLOW)
+      {
+        // 取りこぼしたので走査し直す(新しい監視で読み込みが始まる)
+        rebuild();
+        notify({});
+        return;
+      }
+      auto it = watch_dirs_.find(ev->wd);
+      if (it == watch_dirs_.end())
+        continue;
+      if (ev->mask & IN_IGNORED)
+      {
+        watch_dirs_.erase(it);
+        continue;
+      }
+      if (ev->len == 0)
+        continue;
+      std::string rel  = it->second.empty() ? std::string(ev->name)
+                                            : it->second + "/" + ev->name;
+      fs::path    full = root_ / rel;
+      if (ev->mask & IN_ISDIR)
+      {
+        if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+        {
+          if (filter_.prune(rel))
+            continue;
+          EntryMap added;
+          scan(rel, added);
+          std::unique_lock<std::shared_mutex> l(lock_);
+          for (auto& e : added)
+          {
+            entries_[e.first] = e.second;
+            changed.push_back(e.first);
+          }
+          tree_.reset();
+        }
+        else if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+        {
+          erase_dir(rel);
+        }
+        continue;
+      }
+      if (!filter_.match(rel))
+        continue;
+      changed.push_back(rel);
+      if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+      {
+        std::unique_lock<std::shared_mutex> l(lock_);
+        entries_.erase(rel);
+        tree_.reset();
+      }
+      else
+      {
+        Entry ent;
+        if (FileStat::get(full, ent) == FileStat::Kind::File)
+        {
+          std::unique_lock<std::shared_mutex> l(lock_);
+          entries_[rel] = ent;
+          tree_.reset();
+        }
+      }
+    }
+    if (!changed.empty())
+      notify(changed);
+    read_events(gen, buffer);
+  }
+  // ディレクトリ以下のエントリと監視を削除
+  // (移動の場合は移動先のIN_MOVED_TOで改めて追加される)
+  void erase_dir(const std::string& rel)
+  {
+    auto prefix = rel + "/";
+    auto under  = [&](const std::string& p) {
+      return p.compare(0, prefix.size(), prefix) == 0;
+    };
+    for (auto it = watch_dirs_.begin(); it != watch_dirs_.end();)
+    {
+      if (it->second == rel || under(it->second))
+      {
+        inotify_rm_watch(inotify_fd_, it->first);
+        it = watch_dirs_.erase(it);
+      }
+      else
+      {
+        ++it;
+      }
+    }
+    std::unique_lock<std::shared_mutex> l(lock_);
+    auto                                it = entries_.lower_bound(prefix);
+    while (it != entries_.end() && under(it->first))
+    {
+      it = entries_.erase(it);
+    }
+    tree_.reset();
+  }
+#else
+  bool start_watch() { return false; }
+  void add_watch(const fs::path&) {}
+#endif
+};
+using FileIndexPtr = std::shared_ptr<FileIndex>;
+
+// ディレクトリとフィルタの組ごとのインデックス(全セッションで共有)
+// セッションが終わっても保持し、次の接続では走査し直さずに差分更新を続ける
+// (組み合わせごとに走査結果とinotifyの監視を持つので、使われていないものは
+//  一定時間で破棄し、数が上限を超えたら古いものから破棄する)
+class IndexTable
+{
+  static constexpr size_t MAX_INDEX   = 16;
+  static constexpr auto   IDLE_EXPIRE = std::chrono::minutes(30);
+
+  using Clock = std::chrono::steady_clock;
+  using Key   = std::pair<fs::path, std::string>;
+  struct Item
+  {
+    FileIndexPtr      index_;
+    Clock::time_point used_; // 最後に使われていた時刻
+  };
+
+  std::mutex          lock_;
+  std::map<Key, Item> table_;
+
+public:
+  FileIndexPtr get(asio::io_service& io_service, const fs::path& dir,
+                   const Filter::Filter& filter)
+  {
+    std::lock_guard<std::mutex> l(lock_);
+    auto                        now  = Clock::now();
+    auto&                       item = table_[{dir, filter.key()}];
+    if (!item.index_)
+      item.index_ = std::make_shared<FileIndex>(io_service, dir, filter);
+    item.used_ = now;
+    auto idx   = item.index_;
+    expire(now);
+    return idx;
+  }
+
+private:
+  // セッションが持っているものは使用中とみなす
+  static bool idle(const Item& item) { return item.index_.use_count() == 1; }
+
+  void expire(Clock::time_point now)
+  {
+    for (auto it = table_.begin(); it != table_.end();)
+    {
+      if (!idle(it->second))
+        it->second.used_ = now;
+      if (idle(it->second) && now - it->second.used_ > IDLE_EXPIRE)
+        it = table_.erase(it);
+      else
+        ++it;
+    }
+    while (table_.size() > MAX_INDEX)
+    {
+      auto oldest = table_.end();
+      for (auto it = table_.begin(); it != table_.end(); ++it)
+      {
+        if (!idle(it->second))
+          continue;
+        if (oldest == table_.end() || it->second.used_ < oldest->second.used_)
+          oldest = it;
+      }
+      if (oldest == table_.end())
+        break;
+      table_.erase(oldest);
+    }
+  }
+};
+
+} // namespace Index
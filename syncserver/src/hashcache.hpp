@@ -0,0 +1,95 @@
+//
+// ファイル内容のハッシュのキャッシュ
+//
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <cstdint>
+#include <filestat.hpp>
+#include <list>
+#include <map>
+#include <md5.hpp>
+#include <mutex>
+#include <string>
+#include <utility>
+
+namespace Index
+{
+namespace fs = boost::filesystem;
+
+// (デバイス, iノード)ごとに、ハッシュを計算した時のサイズ・更新時刻を覚えておき、
+// どちらも変わっていなければ計算し直さない
+// 削除されたファイルの分も残るので、上限を超えたら最も長く使われていないものから
+// 捨てる(1エントリ200バイト程度)
+class HashCache
+{
+  using Key = std::pair<uint64_t, uint64_t>;
+  struct Value
+  {
+    Key            key_;
+    FileStat::Stat stat_;
+    std::string    hash_;
+  };
+  // 前ほど最近使われたもの
+  using LruList = std::list<Value>;
+
+  size_t                           capacity_;
+  std::mutex                       lock_;
+  LruList                          lru_;
+  std::map<Key, LruList::iterator> cache_;
+
+public:
+  explicit HashCache(size_t capacity = 1024 * 1024) : capacity_(capacity) {}
+
+  /// pathの内容のハッシュ(statは一覧を作った時のもの)
+  std::string get(const fs::path& path, const FileStat::Stat& st)
+  {
+    if (st.ino_ == 0)
+    {
+      // iノードの取れない環境ではキャッシュしない
+      return MD5::calc(path.generic_string());
+    }
+    Key key{st.dev_, st.ino_};
+    {
+      std::lock_guard<std::mutex> l(lock_);
+      auto                        it = cache_.find(key);
+      if (it != cache_.end() && it->second->stat_.sameContent(st))
+      {
+        lru_.splice(lru_.begin(), lru_, it->second);
+        return it->second->hash_;
+      }
+    }
+    auto hash = MD5::calc(path.generic_string());
+    // 計算中に書き換えられていたらキャッシュしない
+    FileStat::Stat after;
+    if (FileStat::get(path, after) == FileStat::Kind::File &&
+        after.sameContent(st))
+    {
+      std::lock_guard<std::mutex> l(lock_);
+      put(key, st, hash);
+    }
+    return hash;
+  }
+
+private:
+  void put(const Key& key, const FileStat::Stat& st, const std::string& hash)
+  {
+    auto it = cache_.find(key);
+    if (it != cache_.end())
+    {
+      it->second->stat_ = st;
+      it->second->hash_ = hash;
+      lru_.splice(lru_.begin(), lru_, it->second);
+      return;
+    }
+    lru_.push_front({key, st, hash});
+    cache_.emplace(key, lru_.begin());
+    while (lru_.size() > capacity_)
+    {
+      cache_.erase(lru_.back().key_);
+      lru_.pop_back();
+    }
+  }
+};
+
+} // namespace Index
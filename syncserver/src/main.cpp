@@ -1,22 +1,34 @@
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/process.hpp>
-#include <boost/range/iterator_range.hpp>
-#include <boost/xpressive/xpressive.hpp>
+#include <bundle.hpp>
 #include <connection.hpp>
 #include <cstdio>
 #include <cxxopts.hpp>
+#include <delta.hpp>
+#include <filter.hpp>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <iterator>
 #include <list>
+#include <listing.hpp>
+#include <md5.hpp>
 #include <optional>
+#include <set>
 #include <string>
 #include <thread>
+#if defined(__linux__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "fileindex.hpp"
+#include "hashcache.hpp"
 
 namespace
 {
@@ -31,111 +43,152 @@ bool verboseMode = false;
 // ファイル情報
 struct FileInfo
 {
-  fs::path    full_path_;
-  fs::path    rel_path_;
-  std::string time_;
+  fs::path       full_path_;
+  fs::path       rel_path_;
+  std::string    time_;
+  uintmax_t      size_;
+  FileStat::Stat stat_;
+  std::string    hash_; // 要求された場合のみ
 };
 using FileList = std::list<FileInfo>;
 FileList transFileList;
+// ファイル内容のハッシュ(全セッションで共有)
+Index::HashCache hashCache;
+
+// ディレクトリごとのファイル一覧(全セッションで共有)
+Index::IndexTable indexTable;
+// 一覧の作成・ハッシュ計算用(転送の共通プールを長時間ふさがないよう分ける)
+Concurrent::ThreadPool listPool{std::thread::hardware_concurrency()};
 
-// ファイルリスト作成
-FileList
-makeFilelist(const fs::path path, std::string without)
+// ファイルの先頭size分をページキャッシュに読み込ませる(完了は待たない)
+void
+prefetchFile(const fs::path& path, size_t size)
 {
-  using sregex  = boost::xpressive::sregex;
-  sregex rex    = sregex::compile(without);
-  bool   no_rex = without.empty();
+#if defined(__linux__)
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  ::posix_fadvise(fd, 0, size, POSIX_FADV_WILLNEED);
+  ::close(fd);
+#endif
+}
 
-  FileList tflist;
+// 一覧の1ファイル分(除外はインデックスの走査時に済んでいる)
+FileInfo
+makeFileInfo(const fs::path& root, const std::string& rel,
+             const Index::Entry& ent)
+{
+  FileInfo fi;
+  fi.full_path_ = root / rel;
+  fi.rel_path_  = rel;
+  fi.time_      = std::to_string(ent.mtime_);
+  fi.size_      = ent.size_;
+  fi.stat_      = ent;
   if (verboseMode)
   {
-    std::cout << "Search Path: " << path << std::endl;
+    std::cout << "Append: " << fi.full_path_ << "(" << rel << "): " << fi.time_
+              << std::endl;
   }
-
-  auto it   = fs::recursive_directory_iterator(path);
-  auto dir  = boost::make_iterator_range(it, {});
-  auto rstr = path.generic_string();
-  auto rlen = rstr.length();
-  for (const auto& e : dir)
-  {
-    if (!fs::is_directory(e))
-    {
-      using namespace boost::xpressive;
-      auto   fname = e.path();
-      smatch sm;
-      if (no_rex || !regex_search(fname.generic_string(), sm, rex))
-      {
-        // 除外パターンに掛からなかったので通過
-        auto pstr    = fname.generic_string();
-        auto len     = pstr[rlen] == '/' ? rlen + 1 : rlen;
-        auto relpath = pstr.substr(len);
-        auto wtime   = fs::last_write_time(fname);
-        auto wtstr   = std::to_string(wtime);
-        //
-        FileInfo fi;
-        fi.full_path_ = fname;
-        fi.rel_path_  = relpath;
-        fi.time_      = wtstr;
-        tflist.push_back(fi);
-        if (verboseMode)
-        {
-          std::cout << "Append: " << fname << "(" << relpath << "): " << wtstr
-                    << std::endl;
-        }
-      }
-    }
-  }
-  return tflist;
+  return fi;
 }
 
 //
+// クライアント1接続分
 //
-//
-class Server : public Network::ConnectionBase
+class Session : public Network::ConnectionBase
 {
-  tcp::acceptor acceptor_;
-  work_ptr      work_;
-  fs::path      req_dir_;
-  FileList      filelist_;
+  // 変更をまとめて通知するまでの待ち時間
+  static constexpr auto COALESCE_DELAY = std::chrono::milliseconds(20);
+
+  fs::path              req_dir_;
+  Index::FileIndexPtr   index_;
+  asio::steady_timer    push_timer_;
+  std::set<std::string> push_pending_; // 通知待ちの相対パス
+  bool                  push_all_;     // 全体を送り直す
+  bool                  use_hash_;     // 一覧にハッシュを付ける
+  bool                  bin_list_;     // 一覧をバイナリ形式で分けて送る
+  bool                  use_tree_;     // 一覧の代わりにハッシュ木で比べる
+  bool                  prefetch_;     // 要求の前に先読みの依頼を受ける
 
 public:
-  Server(asio::io_service& io_service)
-      : Network::ConnectionBase(io_service),
-        acceptor_(io_service, tcp::endpoint(tcp::v4(), 34000)),
-        work_(std::make_shared<asio::io_service::work>(io_service))
+  Session(asio::io_service& io_service)
+      : Network::ConnectionBase(io_service), push_timer_(io_service),
+        push_all_(false), use_hash_(false), bin_list_(false),
+        use_tree_(false), prefetch_(false)
   {
   }
-
-  void start() { start_accept(); }
-
-private:
-  // 接続待機
-  void start_accept()
+  ~Session()
   {
-    acceptor_.async_accept(socket_, [&](auto& err) { on_accept(err); });
+    if (verboseMode)
+      std::cout << "transfer done." << std::endl;
   }
 
-  // 接続待機完了
-  void on_accept(const boost::system::error_code& error)
+  void start()
   {
-    if (error)
-    {
-      std::cout << "accept failed: " << error.message() << std::endl;
-      return;
-    }
-
+    socket_.set_option(tcp::no_delay(true));
     start_receive(
-        [&](auto cmd, auto bufflist) { receive_loop(cmd, bufflist); });
+        [&](auto cmd, auto& bufflist) { receive_loop(cmd, bufflist); });
   }
 
+private:
   //
-  void receive_loop(const char* cmd, const Network::BufferList& bufflist)
+  void receive_loop(const char* cmd, const Network::FieldList& bufflist)
   {
     std::string command = cmd;
     bool        finish  = false;
     if (command != "error" && bufflist.size() > 0)
     {
-      if (command == "request")
+      if (command == "hello")
+      {
+        // 転送ブロックサイズ・圧縮形式の取り決め(範囲はサーバ側で丸める)
+        bool adaptive = bufflist.size() > 1 && bufflist[1] == "adaptive";
+        auto bsize    = setBlockSize(Network::toNumber(bufflist[0]), adaptive);
+        if (bufflist.size() > 2)
+        {
+          try
+          {
+            setCodec(Codec::parse(std::string(bufflist[2])));
+          }
+          catch (std::exception& e)
+          {
+            // 知らない形式は既定値(LZ4)で送る
+            std::cout << e.what() << std::endl;
+          }
+        }
+        // 以降はクライアントが使いたい機能(応答に含めて受け付けたことを知らせる)
+        //  hash    : 一覧にハッシュを付ける
+        //  binlist : 一覧をバイナリ形式で分けて送る
+        //  tree    : 一覧の代わりにハッシュ木で違うディレクトリを探す(binlistが前提)
+        //  prefetch: これから要求するファイルを先に知らせる
+        Network::BufferList reply{std::to_string(bsize),
+                                  Codec::toString(codec_)};
+        for (size_t i = 3; i < bufflist.size(); i++)
+        {
+          if (bufflist[i] == "hash")
+            use_hash_ = true;
+          else if (bufflist[i] == "binlist")
+            bin_list_ = true;
+          else if (bufflist[i] == "tree" && bin_list_)
+            use_tree_ = true;
+          else if (bufflist[i] == "prefetch")
+            prefetch_ = true;
+          else
+            continue;
+          reply.emplace_back(bufflist[i]);
+        }
+        if (verboseMode)
+          std::cout << "block size: " << bsize
+                    << (adaptive ? "(adaptive)" : "")
+                    << " codec: " << Codec::toString(codec_)
+                    << (use_hash_ ? " hash" : "")
+                    << (bin_list_ ? " binlist" : "")
+                    << (use_tree_ ? " tree" : "")
+                    << (prefetch_ ? " prefetch" : "") << std::endl;
+        send("hello", reply, [&](bool) {});
+        start_receive(
+            [&](auto cmd, auto& bufflist) { receive_loop(cmd, bufflist); });
+      }
+      else if (command == "request")
       {
         if (bufflist[0] == "filelist")
         {
@@ -143,7 +196,7 @@ private:
           std::string without_regex;
           if (bufflist.size() > 1)
           {
-            source_path = bufflist[1];
+            source_path = std::string(bufflist[1]);
             if (bufflist.size() > 2)
             {
               without_regex = bufflist[2];
@@ -153,47 +206,391 @@ private:
               std::cout << "Source Path: " << source_path << std::endl;
               std::cout << "Without Regex: " << without_regex << std::endl;
             }
-            // リストの更新
-            req_dir_  = source_path.lexically_normal();
-            filelist_ = makeFilelist(req_dir_, without_regex);
           }
-          return_file_list();
+          // リストの更新
+          // 除外ルール: 従来の-w(空なら無し)に続いて追加のルール
+          req_dir_ = source_path.lexically_normal();
+          try
+          {
+            Filter::Filter filter{req_dir_};
+            for (size_t i = 2; i < bufflist.size(); i++)
+            {
+              if (!bufflist[i].empty())
+                filter.exclude(std::string(bufflist[i]));
+            }
+            index_ = indexTable.get(io_service_, req_dir_, filter);
+          }
+          catch (std::exception& e)
+          {
+            std::cout << e.what() << std::endl;
+            send("finish", {e.what()}, [&](bool) {});
+            return;
+          }
+          if (use_tree_)
+            return_tree_root();
+          else
+            return_file_list();
         }
         // 次の指示を待つ
         start_receive(
-            [&](auto cmd, auto bufflist) { receive_loop(cmd, bufflist); });
+            [&](auto cmd, auto& bufflist) { receive_loop(cmd, bufflist); });
       }
       else if (command == "filereq")
       {
         // ファイルを送り返す
-        fs::path fname = (req_dir_ / bufflist[0]).lexically_normal();
+        // 送信完了を待たずに次の要求を受け付ける(クライアントは複数要求を先行して出す)
+        fs::path fname =
+            (req_dir_ / std::string(bufflist[0])).lexically_normal();
+        uint32_t stream =
+            bufflist.size() > 1 ? Network::toNumber(bufflist[1]) : 0;
+        uint64_t offset =
+            bufflist.size() > 3 ? Network::toNumber(bufflist[2]) : 0;
         std::cout << "request: " << fname << std::endl;
-        sendFile(fname.generic_string(), [&](bool s) {
-          //
-          start_receive(
-              [&](auto cmd, auto bufflist) { receive_loop(cmd, bufflist); });
+        if (offset == 0)
+        {
+          sendFile(fname.generic_string(), stream, [](bool) {});
+        }
+        else
+        {
+          // 受信済み部分が一致していれば続きから送る
+          Concurrent::ThreadPool::shared().post(
+              [this,
+               self = shared_from_this(),
+               fname,
+               stream,
+               offset,
+               hash = std::string(bufflist[3])]() {
+                boost::system::error_code err;
+                auto                      size  = fs::file_size(fname, err);
+                bool                      match = !err && size >= offset &&
+                             MD5::calc(fname.generic_string(), offset) == hash;
+                if (verboseMode)
+                  std::cout << "resume: " << fname << " from "
+                            << (match ? offset : 0) << std::endl;
+                sendFile(fname.generic_string(),
+                         stream,
+                         [](bool) {},
+                         match ? offset : 0);
+              });
+        }
+        start_receive(
+            [&](auto cmd, auto& bufflist) { receive_loop(cmd, bufflist); });
+      }
+      else if (command == "bundlereq")
+      {
+        // 小さいファイルをまとめて送り返す(読み込みはワーカーで行う)
+        uint32_t stream = Network::toNumber(bufflist[0]);
+        Concurrent::ThreadPool::shared().post(
+            [this,
+             self  = shared_from_this(),
+             dir   = req_dir_,
+             names = Network::toList(bufflist),
+             stream]() {
+              Network::Buffer bundle;
+              for (size_t i = 1; i < names.size(); i++)
+              {
+                fs::path fname = (dir / names[i]).lexically_normal();
+                if (!Bundle::append(bundle, names[i], fname))
+                  std::cout << "read failed: " << fname << std::endl;
+              }
+              if (verboseMode)
+                std::cout << "bundle: " << names.size() - 1 << " files, "
+                          << bundle.size() << " bytes" << std::endl;
+              sendBuffer(std::move(bundle), stream, [](bool) {});
+            });
+        start_receive(
+            [&](auto cmd, auto& bufflist) { receive_loop(cmd, bufflist); });
+      }
+      else if (command == "deltareq")
+      {
+        // 続いて届くシグネチャから差分を作って送り返す
+        uint32_t stream = Network::toNumber(bufflist[0]);
+        fs::path fname =
+            (req_dir_ / std::string(bufflist[1])).lexically_normal();
+        std::cout << "delta request: " << fname << std::endl;
+        receiveBuffer(stream, [this, stream, fname](bool ok, auto& data) {
+          if (!ok)
+          {
+            // シグネチャが壊れていたら空の差分で全体を取り直させる
+            sendBuffer({}, stream, [](bool) {});
+            return;
+          }
+          auto sig = std::make_shared<Network::Buffer>(std::move(data));
+          Concurrent::ThreadPool::shared().post(
+              [this, self = shared_from_this(), stream, fname, sig]() {
+                auto tmp = fs::temp_directory_path() /
+                           fs::unique_path("syncdelta-%%%%-%%%%-%%%%-%%%%");
+                if (!Delta::generate(fname, *sig, tmp))
+                {
+                  // 受信側は組み立てに失敗してファイル全体を要求し直す
+                  std::cout << "delta failed: " << fname << std::endl;
+                  boost::system::error_code err;
+                  fs::remove(tmp, err);
+                  sendBuffer({}, stream, [&](bool) {});
+                  return;
+                }
+                sendFile(tmp.generic_string(), stream, [tmp](bool) {
+                  boost::system::error_code err;
+                  fs::remove(tmp, err);
+                });
+              });
         });
+        start_receive(
+            [&](auto cmd, auto& bufflist) { receive_loop(cmd, bufflist); });
+      }
+      else if (command == "treereq")
+      {
+        // 要約の違ったディレクトリの中身
+        if (index_)
+          return_tree_nodes(Network::toList(bufflist));
+        start_receive(
+            [&](auto cmd, auto& bufflist) { receive_loop(cmd, bufflist); });
+      }
+      else if (command == "prefetch")
+      {
+        // 続いて要求されるファイルの先頭を読み込ませておく
+        prefetch(Network::toList(bufflist));
+        start_receive(
+            [&](auto cmd, auto& bufflist) { receive_loop(cmd, bufflist); });
+      }
+      else if (command == "watch")
+      {
+        // 以降、要求したディレクトリの変更をクライアントに通知し続ける
+        start_watch();
+        start_receive(
+            [&](auto cmd, auto& bufflist) { receive_loop(cmd, bufflist); });
       }
       else if (command == "finish")
       {
-        // 終了
-        work_.reset();
+        // 終了(受信を再開しないので、送信が終わればセッションは破棄される)
       }
     }
   }
 
-  //
+  // 変更通知の登録(セッションが無くなれば登録も外れる)
+  void start_watch()
+  {
+    std::weak_ptr<ConnectionBase> weak = shared_from_this();
+    bool                          ok   = index_ && index_->subscribe(
+                              [this, weak](const Index::PathList& changed) {
+                                auto self = weak.lock();
+                                if (!self)
+                                  return false;
+                                asio::post(strand_, [this, self, changed]() {
+                                  on_changed(changed);
+                                });
+                                return true;
+                              });
+    if (!ok)
+    {
+      send("finish", {"watch is not supported"}, [&](bool) {});
+      return;
+    }
+    if (verboseMode)
+      std::cout << "watch: " << req_dir_ << std::endl;
+  }
+  // 続けて来る変更は少し待ってからまとめて通知する
+  void on_changed(const Index::PathList& changed)
+  {
+    bool armed = push_all_ || !push_pending_.empty();
+    if (changed.empty())
+      push_all_ = true;
+    push_pending_.insert(changed.begin(), changed.end());
+    if (armed)
+      return;
+    push_timer_.expires_after(COALESCE_DELAY);
+    push_timer_.async_wait(asio::bind_executor(
+        strand_, [this, self = shared_from_this()](auto& err) {
+          if (!err)
+            push_changes();
+        }));
+  }
+  void push_changes()
+  {
+    if (push_all_)
+    {
+      // 取りこぼしがあったので一覧ごと送り直す(クライアントは更新時刻で選ぶ)
+      push_all_ = false;
+      push_pending_.clear();
+      return_file_list();
+      return;
+    }
+    auto list = std::make_shared<FileList>();
+    for (auto& rel : push_pending_)
+    {
+      // 削除されたものは送らない
+      Index::Entry ent;
+      if (!index_->find(rel, ent))
+        continue;
+      list->push_back(makeFileInfo(index_->root(), rel, ent));
+    }
+    push_pending_.clear();
+    if (!list->empty())
+      send_list("update", list);
+  }
+
+  // 先読み(ネットワークストレージではopen自体も待たされるのでワーカーで行う)
+  void prefetch(Network::BufferList names)
+  {
+    // 1タスクで扱うファイル数
+    static constexpr size_t PREFETCH_CHUNK = 8;
+
+    auto files = std::make_shared<Network::BufferList>(std::move(names));
+    for (size_t first = 0; first < files->size(); first += PREFETCH_CHUNK)
+    {
+      Concurrent::ThreadPool::shared().post(
+          [self = shared_from_this(),
+           dir  = req_dir_,
+           size = block_size_,
+           files,
+           first]() {
+            auto last = std::min(files->size(), first + PREFETCH_CHUNK);
+            for (auto i = first; i < last; i++)
+              prefetchFile((dir / (*files)[i]).lexically_normal(), size);
+          });
+    }
+  }
+
+  // 一覧の送信(走査・ハッシュ計算はワーカーで行う)
+  // binlistならインデックスから渡されるまとまりごとにすぐ送り、
+  // 最後に"filelistend"(ファイル数)を送る
+  // そうでなければ従来通り全体を1つのメッセージで送る
   void return_file_list()
   {
+    listPool.post([this, self = shared_from_this(), index = index_]() {
+      std::mutex         lock;
+      FileList           all;
+      std::atomic_size_t total{0};
+      index->list([&](const Walk::EntryList& chunk) {
+        FileList list;
+        for (auto& e : chunk)
+        {
+          list.push_back(makeFileInfo(index->root(), e.path_, e));
+          if (use_hash_)
+            list.back().hash_ = hashCache.get(list.back().full_path_, e);
+        }
+        total += list.size();
+        if (bin_list_)
+        {
+          send_file_list("filelist", list);
+          return;
+        }
+        std::lock_guard<std::mutex> l(lock);
+        all.splice(all.end(), list);
+      });
+      if (bin_list_)
+      {
+        send("filelistend", {std::to_string(total)}, [&](bool) {});
+        return;
+      }
+      all.sort([](auto& a, auto& b) { return a.rel_path_ < b.rel_path_; });
+      send_file_list("filelist", all);
+    });
+  }
+  // ハッシュ木の最上位の要約を送る
+  // クライアントは手元の要約と違っていればtreereqで下の階層を要求してくる
+  void return_tree_root()
+  {
+    listPool.post([this, self = shared_from_this(), index = index_]() {
+      send("treeroot", {index->tree()->digest("")}, [&](bool) {});
+    });
+  }
+  // 要求されたディレクトリごとに、直下のファイルの一覧("filelist")と
+  // サブディレクトリの要約("treedirs": ディレクトリ, (名前, 要約)*)を送り、
+  // 最後に"treeend"を送る
+  void return_tree_nodes(Network::BufferList dirs)
+  {
+    listPool.post([this, self = shared_from_this(), index = index_, dirs]() {
+      auto tree = index->tree();
+      for (auto& dir : dirs)
+      {
+        auto node = tree->find(dir);
+        if (!node)
+          continue;
+        FileList list;
+        for (auto& f : node->files_)
+        {
+          auto rel = DirTree::Tree::join(dir, f.first);
+          list.push_back(makeFileInfo(index->root(), rel, f.second));
+          if (use_hash_)
+            list.back().hash_ =
+                hashCache.get(list.back().full_path_, f.second);
+        }
+        send_file_list("filelist", list);
+        if (node->dirs_.empty())
+          continue;
+        Network::BufferList sub{dir};
+        for (auto& d : node->dirs_)
+        {
+          sub.push_back(d);
+          sub.push_back(tree->digest(DirTree::Tree::join(dir, d)));
+        }
+        send("treedirs", sub, [&](bool) {});
+      }
+      send("treeend", {std::to_string(dirs.size())}, [&](bool) {});
+    });
+  }
+  // 一覧の送信(path, time, size[, hash]の並び)
+  // ハッシュはキャッシュに無いものだけワーカーで並列に計算してから送る
+  void send_list(const char* cmd, std::shared_ptr<FileList> list)
+  {
+    auto& pool    = listPool;
+    auto  nb_task = std::min(list->size(), pool.size());
+    if (!use_hash_ || nb_task == 0)
+    {
+      send_file_list(cmd, *list);
+      return;
+    }
+    auto items = std::make_shared<std::vector<FileInfo*>>();
+    for (auto& f : *list)
+      items->push_back(&f);
+    auto next   = std::make_shared<std::atomic_size_t>(0);
+    auto remain = std::make_shared<std::atomic_size_t>(nb_task);
+    for (size_t t = 0; t < nb_task; t++)
+    {
+      pool.post(
+          [this, self = shared_from_this(), cmd, list, items, next, remain]() {
+            for (size_t i; (i = (*next)++) < items->size();)
+            {
+              auto& fi = *(*items)[i];
+              fi.hash_ = hashCache.get(fi.full_path_, fi.stat_);
+            }
+            if (--*remain == 0)
+            {
+              asio::post(strand_, [this, self, cmd, list]() {
+                send_file_list(cmd, *list);
+              });
+            }
+          });
+    }
+  }
+  void send_file_list(const char* cmd, const FileList& list)
+  {
+    if (bin_list_)
+    {
+      Listing::Encoder enc;
+      for (auto& f : list)
+      {
+        enc.add(f.rel_path_.generic_string(), f.stat_.mtime_, f.size_, f.hash_);
+        if (enc.full())
+          sendRaw(cmd, enc.take(), [&](bool) {});
+      }
+      if (!enc.empty())
+        sendRaw(cmd, enc.take(), [&](bool) {});
+      return;
+    }
     try
     {
       Network::BufferList send_fl;
-      for (auto& f : filelist_)
+      for (auto& f : list)
       {
         send_fl.push_back(f.rel_path_.generic_string());
         send_fl.push_back(f.time_);
+        send_fl.push_back(std::to_string(f.size_));
+        if (use_hash_)
+          send_fl.push_back(f.hash_);
       }
-      send("filelist", send_fl, [&](bool) {});
+      send(cmd, send_fl, [&](bool) {});
     }
     catch (std::exception& e)
     {
@@ -202,6 +599,52 @@ private:
   }
 };
 
+//
+// 接続待機(接続ごとにSessionを生成する)
+//
+class Server
+{
+  asio::io_service& io_service_;
+  tcp::acceptor     acceptor_;
+
+public:
+  Server(asio::io_service& io_service)
+      : io_service_(io_service),
+        acceptor_(io_service, tcp::endpoint(tcp::v4(), 34000))
+  {
+  }
+
+  void start() { start_accept(); }
+
+private:
+  // 接続待機
+  void start_accept()
+  {
+    auto session = std::make_shared<Session>(io_service_);
+    acceptor_.async_accept(session->socket(), [this, session](auto& err) {
+      on_accept(session, err);
+    });
+  }
+
+  // 接続待機完了
+  void on_accept(std::shared_ptr<Session>         session,
+                 const boost::system::error_code& error)
+  {
+    if (error)
+    {
+      std::cout << "accept failed: " << error.message() << std::endl;
+    }
+    else
+    {
+      if (verboseMode)
+        std::cout << "connect: " << session->socket().remote_endpoint()
+                  << std::endl;
+      session->start();
+    }
+    start_accept();
+  }
+};
+
 } // namespace
 
 int
@@ -212,6 +655,9 @@ main(int argc, char** argv)
                            "directory synchronize server");
 
   options.add_options()("h,help", "Print usage")(
+      "j,job",
+      "number of io threads",
+      cxxopts::value<int>()->default_value("-1"))(
       "v,verbose",
       "verbose mode",
       cxxopts::value<bool>()->default_value("false"));
@@ -226,16 +672,27 @@ main(int argc, char** argv)
   verboseMode = result["verbose"].as<bool>();
 
   // サーバ起動
-  for (;;)
+  // 1つのio_serviceを複数スレッドで回し、各クライアントを並列に処理する
+  int  njobs     = result["job"].as<int>();
+  int  maxjobs   = njobs <= 0 ? std::thread::hardware_concurrency() : njobs;
+  auto nb_thread = std::max(1, maxjobs);
+
+  asio::io_service io_service;
+  work_ptr         work = std::make_shared<asio::io_service::work>(io_service);
+  Server           server(io_service);
+  server.start();
+  if (verboseMode)
+    std::cout << "Server launch(waiting...) threads: " << nb_thread
+              << std::endl;
+
+  std::list<std::thread> thList;
+  for (int i = 0; i < nb_thread; i++)
   {
-    if (verboseMode)
-      std::cout << "Server launch(waiting...)" << std::endl;
-    asio::io_service io_service;
-    Server           server(io_service);
-    server.start();
-    io_service.run();
-    if (verboseMode)
-      std::cout << "transfer done." << std::endl;
+    thList.emplace_back([&]() { io_service.run(); });
+  }
+  for (auto& th : thList)
+  {
+    th.join();
   }
 
   return 0;